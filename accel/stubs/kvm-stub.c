@@ -109,6 +109,11 @@ bool kvm_memcrypt_enabled(void)
     return false;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
 int kvm_memcrypt_encrypt_data(uint8_t *ptr, uint64_t len)
 {
   return 1;
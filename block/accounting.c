@@ -27,6 +27,7 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
@@ -182,6 +183,85 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+int64_t block_acct_clock_ns(void)
+{
+    return qemu_clock_get_ns(clock_type);
+}
+
+static unsigned block_latency_log_bucket(uint64_t ns)
+{
+    const int sub_bits = BLOCK_LATENCY_LOG_SUB_BITS;
+    int msb;
+
+    if (ns < (1 << sub_bits)) {
+        return ns;
+    }
+
+    msb = MIN(63 - clz64(ns), BLOCK_LATENCY_LOG_MAX_BITS - 1);
+    return ((msb - sub_bits + 1) << sub_bits) |
+           ((ns >> (msb - sub_bits)) & ((1 << sub_bits) - 1));
+}
+
+/* Returns the first latency that does not fall into bucket @idx anymore */
+static uint64_t block_latency_log_bucket_limit(unsigned idx)
+{
+    unsigned sub_mask = (1 << BLOCK_LATENCY_LOG_SUB_BITS) - 1;
+    unsigned shift;
+
+    if (idx <= sub_mask) {
+        return idx + 1;
+    }
+
+    shift = (idx >> BLOCK_LATENCY_LOG_SUB_BITS) - 1;
+    return (uint64_t)(((idx & sub_mask) | (sub_mask + 1)) + 1) << shift;
+}
+
+void block_latency_log_add(BlockLatencyLog *log, uint64_t latency_ns)
+{
+    /*
+     * Update the buckets before the count, so that a concurrent reader never
+     * sees more requests in @count than it can find in the buckets.
+     */
+    stat64_add(&log->buckets[block_latency_log_bucket(latency_ns)], 1);
+    stat64_add(&log->total_ns, latency_ns);
+    stat64_max(&log->max_ns, latency_ns);
+    stat64_add(&log->count, 1);
+}
+
+void block_latency_log_account(BlockLatencyLog *log, int64_t start_ns)
+{
+    int64_t latency_ns = qemu_clock_get_ns(clock_type) - start_ns;
+
+    block_latency_log_add(log, MAX(latency_ns, 0));
+}
+
+/*
+ * Returns an upper bound for the latency that @permille thousandths of the
+ * recorded requests did not exceed.  The bound is at most 25% (with two
+ * sub-bucket bits) above the exact value, and never above the maximum.
+ */
+uint64_t block_latency_log_percentile(BlockLatencyLog *log, unsigned permille)
+{
+    uint64_t count = stat64_get(&log->count);
+    uint64_t max_ns = stat64_get(&log->max_ns);
+    uint64_t target, seen = 0;
+    unsigned i;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    target = MAX(DIV_ROUND_UP(count * permille, 1000), 1);
+    for (i = 0; i < BLOCK_LATENCY_LOG_BUCKETS; i++) {
+        seen += stat64_get(&log->buckets[i]);
+        if (seen >= target) {
+            return MIN(block_latency_log_bucket_limit(i) - 1, max_ns);
+        }
+    }
+
+    return max_ns;
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -206,6 +286,9 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
     block_latency_histogram_account(&stats->latency_histogram[cookie->type],
                                     latency_ns);
+    block_latency_log_add(
+        &stats->stage_latency[BLOCK_ACCT_STAGE_DEVICE][cookie->type],
+        latency_ns);
 
     if (!failed || stats->account_failed) {
         stats->total_time_ns[cookie->type] += latency_ns;
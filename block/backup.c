@@ -27,6 +27,7 @@
 #include "qemu/error-report.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_IN_FLIGHT 16
 
 typedef struct CowRequest {
     int64_t start_byte;
@@ -56,8 +57,20 @@ typedef struct BackupBlockJob {
     int64_t copy_range_size;
 
     bool serialize_target_writes;
+
+    /* Copy tasks started by backup_loop() */
+    int in_flight;
+    CoQueue task_queue; /* backup_loop() waiting for a free task slot */
+    int task_ret;
+    bool task_error_is_read;
 } BackupBlockJob;
 
+typedef struct BackupTask {
+    BackupBlockJob *job;
+    int64_t offset;
+    int64_t bytes;
+} BackupTask;
+
 static const BlockJobDriver backup_job_driver;
 
 /* See if in-flight requests overlap and wait for them to complete */
@@ -384,35 +397,114 @@ static bool bdrv_is_unallocated_range(BlockDriverState *bs,
     return offset >= end;
 }
 
+static void coroutine_fn backup_task_entry(void *opaque)
+{
+    BackupTask *task = opaque;
+    BackupBlockJob *job = task->job;
+    bool error_is_read = false;
+    int ret;
+
+    ret = backup_do_cow(job, task->offset, task->bytes, &error_is_read, false);
+    if (ret < 0 && job->task_ret == 0) {
+        job->task_ret = ret;
+        job->task_error_is_read = error_is_read;
+    }
+
+    trace_backup_task_done(job, task->offset, task->bytes, ret);
+    job->in_flight--;
+    qemu_co_queue_restart_all(&job->task_queue);
+    g_free(task);
+}
+
+static void coroutine_fn backup_wait_for_tasks(BackupBlockJob *job, int max)
+{
+    while (job->in_flight > max) {
+        qemu_co_queue_wait(&job->task_queue, NULL);
+    }
+}
+
+/*
+ * Start copy tasks for the dirty areas of copy_bitmap, keeping up to
+ * BACKUP_MAX_IN_FLIGHT of them running at once.  Returns the first
+ * error that the error policy wants reported, or 0 once the bitmap has
+ * been walked or the job has been cancelled.  Failed tasks put their
+ * clusters back into copy_bitmap, so after an error that is not
+ * reported the walk restarts from the beginning.
+ */
 static int coroutine_fn backup_loop(BackupBlockJob *job)
 {
     int ret;
-    bool error_is_read;
-    int64_t offset;
-    HBitmapIter hbi;
+    uint64_t offset, bytes;
+    uint64_t chunk;
+    BackupTask *task;
+    Coroutine *co;
     BlockDriverState *bs = blk_bs(job->common.blk);
 
-    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
-    while ((offset = hbitmap_iter_next(&hbi)) != -1) {
+    qemu_co_queue_init(&job->task_queue);
+
+retry:
+    offset = 0;
+    while (!job->task_ret) {
+        if (yield_and_check(job)) {
+            break;
+        }
+        backup_wait_for_tasks(job, BACKUP_MAX_IN_FLIGHT - 1);
+        if (job->task_ret) {
+            break;
+        }
+
+        bytes = job->len - offset;
+        if (!hbitmap_next_dirty_area(job->copy_bitmap, &offset, &bytes)) {
+            break;
+        }
+
+        /*
+         * copy_range can take whole runs of clusters in one request; the
+         * bounce buffer path copies cluster by cluster anyway, so give
+         * each task a single cluster there and let the tasks overlap.
+         * For sync=top allocation is checked per cluster, too.
+         */
+        chunk = job->use_copy_range ? job->copy_range_size : job->cluster_size;
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+            chunk = job->cluster_size;
+        }
+        bytes = MIN(bytes, chunk);
+
         if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
-            bdrv_is_unallocated_range(bs, offset, job->cluster_size))
+            bdrv_is_unallocated_range(bs, offset, bytes))
         {
-            hbitmap_reset(job->copy_bitmap, offset, job->cluster_size);
+            hbitmap_reset(job->copy_bitmap, offset, bytes);
+            offset += bytes;
             continue;
         }
 
-        do {
-            if (yield_and_check(job)) {
-                return 0;
-            }
-            ret = backup_do_cow(job, offset,
-                                job->cluster_size, &error_is_read, false);
-            if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
-                           BLOCK_ERROR_ACTION_REPORT)
-            {
-                return ret;
-            }
-        } while (ret < 0);
+        task = g_new(BackupTask, 1);
+        *task = (BackupTask) {
+            .job    = job,
+            .offset = offset,
+            .bytes  = bytes,
+        };
+        offset += bytes;
+
+        trace_backup_task_start(job, task->offset, task->bytes, job->in_flight);
+        job->in_flight++;
+        co = qemu_coroutine_create(backup_task_entry, task);
+        qemu_coroutine_enter(co);
+    }
+
+    backup_wait_for_tasks(job, 0);
+
+    ret = job->task_ret;
+    if (ret < 0) {
+        job->task_ret = 0;
+        if (backup_error_action(job, job->task_error_is_read, -ret) ==
+            BLOCK_ERROR_ACTION_REPORT)
+        {
+            return ret;
+        }
+        if (!job_is_cancelled(&job->common.job)) {
+            goto retry;
+        }
     }
 
     return 0;
@@ -0,0 +1,1670 @@
+/*
+ * Persistent block cache filter driver
+ *
+ * Copyright (c) 2019 The QEMU Project Developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The filter keeps copies of blocks of its file child (the origin, e.g. an
+ * image on slow shared storage) in its cache-file child, typically an image
+ * on a local SSD.  The cache survives restarts, and a cache that holds no
+ * dirty blocks can be opened in readonly mode by several VMs at once.
+ *
+ * Cache file layout, all numbers are big endian:
+ *
+ *   header   at offset 0, BlkcacheHeader, which also records the filename
+ *            and size of the origin that the cache belongs to
+ *   index    at index_offset, two copies of index_size bytes each, with one
+ *            BlkcacheIndexEntry per slot
+ *   slots    at data_offset, nb_blocks slots of block_size bytes each
+ *
+ * The index on disk is only written by commits, which flush the slot data
+ * first.  The parity of the header generation selects the current copy of
+ * the index.  A commit writes the other copy, flushes it and only then
+ * increments the generation, so a crash in the middle of a commit leaves the
+ * previous index intact.  A slot that the current index still refers to is
+ * not reused for another block until a commit has recorded that it is free,
+ * so after a crash the index never points to data of a different block.
+ *
+ * Clean blocks are written in place, so after a crash their slots may be
+ * torn or older than the origin; recovery drops all of them.  A dirty block
+ * that the index on disk refers to is the only copy of its data, so writes
+ * to it go to a new slot and the old one is kept until the next commit.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define BLKCACHE_MAGIC              0x51424c4b43414348ULL /* "QBLKCACH" */
+#define BLKCACHE_VERSION            2
+
+#define BLKCACHE_HEADER_SIZE        4096
+
+/* The cache is open read-write, it was not closed cleanly if set on open */
+#define BLKCACHE_HF_OPEN            (1 << 0)
+
+#define BLKCACHE_ENTRY_VALID        (1 << 0)
+#define BLKCACHE_ENTRY_DIRTY        (1 << 1)
+
+#define BLKCACHE_DEFAULT_BLOCK_SIZE (64 * KiB)
+#define BLKCACHE_MIN_BLOCK_SIZE     (4 * KiB)
+#define BLKCACHE_MAX_BLOCK_SIZE     (2 * MiB)
+#define BLKCACHE_DEFAULT_CACHE_SIZE (1 * GiB)
+#define BLKCACHE_MAX_BLOCKS         (1 << 24)
+
+/* Index entries written by one commit request */
+#define BLKCACHE_INDEX_PAGE_SIZE    4096
+#define BLKCACHE_INDEX_PAGE_ENTRIES \
+    (BLKCACHE_INDEX_PAGE_SIZE / sizeof(BlkcacheIndexEntry))
+
+/* Commit the index after this many new blocks, even without a flush */
+#define BLKCACHE_COMMIT_FILLS       1024
+
+/* Slots that are evicted before committing the index to reuse them */
+#define BLKCACHE_EVICT_BATCH(s)     MAX((s)->nb_blocks / 64, 1)
+
+/* Largest run of missing blocks that is read from the origin at once */
+#define BLKCACHE_MAX_MISS_BYTES     (1 * MiB)
+
+typedef struct BlkcacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t nb_blocks;
+    uint64_t origin_size;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint64_t generation;
+    char origin[1024];      /* NUL terminated, empty if unknown */
+} QEMU_PACKED BlkcacheHeader;
+
+typedef struct BlkcacheIndexEntry {
+    uint64_t block;
+    uint32_t flags;
+    uint32_t reserved;
+} QEMU_PACKED BlkcacheIndexEntry;
+
+typedef struct BlkcacheSlot {
+    uint64_t block;         /* origin block cached in this slot */
+    bool valid;
+    bool dirty;             /* newer than the origin */
+    bool committed;         /* the index on disk refers to this slot */
+    bool committed_dirty;   /* ... as dirty, so the data must stay intact */
+    bool referenced;        /* second chance for the clock */
+    bool busy;              /* being filled or written back */
+} BlkcacheSlot;
+
+/* A request locks the blocks it touches against overlapping requests */
+typedef struct BlkcacheReq {
+    uint64_t first;
+    uint64_t last;
+    CoQueue waiters;
+    QLIST_ENTRY(BlkcacheReq) next;
+} BlkcacheReq;
+
+typedef struct BDRVBlkcacheState {
+    BdrvChild *cache;
+    BlkcacheMode mode;
+
+    uint32_t block_size;
+    uint64_t nb_blocks;
+    uint64_t index_offset;
+    uint64_t index_size;        /* bytes of one copy of the index */
+    uint64_t data_offset;
+    uint64_t generation;
+    uint32_t header_flags;
+    bool header_dirty;          /* the header on disk may be outdated */
+    int64_t size;
+
+    BlkcacheSlot *slots;
+    GHashTable *map;            /* origin block -> BlkcacheSlot */
+    unsigned long *index_dirty; /* slots whose index entry changed */
+    unsigned long *index_stale; /* pages the other index copy lacks */
+    uint64_t clock_hand;
+    unsigned int fills;         /* new blocks since the last commit */
+
+    QLIST_HEAD(, BlkcacheReq) reqs;
+    CoMutex commit_lock;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t used_blocks;
+    uint64_t dirty_blocks;
+} BDRVBlkcacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "blkcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "mode",
+            .type = QEMU_OPT_STRING,
+            .help = "Cache mode (writethrough, writeback, readonly)",
+        },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached data when creating a cache file",
+        },
+        {
+            .name = "block-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Cache block size when creating a cache file",
+        },
+        { /* end of list */ }
+    },
+};
+
+static BdrvChildRole child_blkcache;
+
+/* Offset of the index copy that the header generation @generation selects */
+static inline uint64_t blkcache_index_copy(BDRVBlkcacheState *s,
+                                           uint64_t generation)
+{
+    return s->index_offset + (generation & 1) * s->index_size;
+}
+
+static inline uint64_t blkcache_slot_offset(BDRVBlkcacheState *s,
+                                            BlkcacheSlot *slot)
+{
+    return s->data_offset + (uint64_t)(slot - s->slots) * s->block_size;
+}
+
+/* Bytes of the origin in @block, short for the last block of the image */
+static inline int64_t blkcache_block_bytes(BDRVBlkcacheState *s,
+                                           uint64_t block)
+{
+    return MIN(s->block_size, s->size - (int64_t)block * s->block_size);
+}
+
+static inline BlkcacheSlot *blkcache_lookup(BDRVBlkcacheState *s,
+                                            uint64_t block)
+{
+    return g_hash_table_lookup(s->map, &block);
+}
+
+static void blkcache_slot_changed(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    set_bit(slot - s->slots, s->index_dirty);
+}
+
+static void blkcache_set_dirty(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    if (!slot->dirty) {
+        slot->dirty = true;
+        s->dirty_blocks++;
+        blkcache_slot_changed(s, slot);
+    }
+}
+
+static void blkcache_insert(BDRVBlkcacheState *s, BlkcacheSlot *slot,
+                            uint64_t block)
+{
+    slot->block = block;
+    slot->valid = true;
+    slot->referenced = false;
+    g_hash_table_insert(s->map, &slot->block, slot);
+    s->used_blocks++;
+    blkcache_slot_changed(s, slot);
+}
+
+/* Forget the block in @slot; the caller writes back dirty data first */
+static void blkcache_drop(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    g_hash_table_remove(s->map, &slot->block);
+    if (slot->dirty) {
+        slot->dirty = false;
+        s->dirty_blocks--;
+    }
+    slot->valid = false;
+    s->used_blocks--;
+    blkcache_slot_changed(s, slot);
+}
+
+static bool blkcache_locked(BDRVBlkcacheState *s, uint64_t first,
+                            uint64_t last)
+{
+    BlkcacheReq *req;
+
+    QLIST_FOREACH(req, &s->reqs, next) {
+        if (first <= req->last && req->first <= last) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void coroutine_fn blkcache_req_begin(BDRVBlkcacheState *s,
+                                            BlkcacheReq *req,
+                                            uint64_t offset, uint64_t bytes)
+{
+    BlkcacheReq *other;
+
+    req->first = offset / s->block_size;
+    req->last = (offset + MAX(bytes, 1) - 1) / s->block_size;
+    qemu_co_queue_init(&req->waiters);
+
+retry:
+    QLIST_FOREACH(other, &s->reqs, next) {
+        if (req->first <= other->last && other->first <= req->last) {
+            qemu_co_queue_wait(&other->waiters, NULL);
+            goto retry;
+        }
+    }
+    QLIST_INSERT_HEAD(&s->reqs, req, next);
+}
+
+static void coroutine_fn blkcache_req_end(BlkcacheReq *req)
+{
+    QLIST_REMOVE(req, next);
+    qemu_co_queue_restart_all(&req->waiters);
+}
+
+static int blkcache_write_header(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheHeader header = {
+        .magic          = cpu_to_be64(BLKCACHE_MAGIC),
+        .version        = cpu_to_be32(BLKCACHE_VERSION),
+        .flags          = cpu_to_be32(s->header_flags),
+        .block_size     = cpu_to_be32(s->block_size),
+        .nb_blocks      = cpu_to_be64(s->nb_blocks),
+        .origin_size    = cpu_to_be64(s->size),
+        .index_offset   = cpu_to_be64(s->index_offset),
+        .data_offset    = cpu_to_be64(s->data_offset),
+        .generation     = cpu_to_be64(s->generation),
+    };
+    int ret;
+
+    QEMU_BUILD_BUG_ON(sizeof(header) > BLKCACHE_HEADER_SIZE);
+    pstrcpy(header.origin, sizeof(header.origin),
+            bs->file->bs->exact_filename);
+    ret = bdrv_pwrite(s->cache, 0, &header, sizeof(header));
+    if (ret >= 0) {
+        ret = bdrv_flush(s->cache->bs);
+    }
+    s->header_dirty = ret < 0;
+    return ret < 0 ? ret : 0;
+}
+
+/* Index copies consist of whole pages, commits write entire pages */
+static uint64_t blkcache_index_size(uint64_t nb_blocks)
+{
+    return ROUND_UP(nb_blocks * sizeof(BlkcacheIndexEntry),
+                    BLKCACHE_INDEX_PAGE_SIZE);
+}
+
+static bool blkcache_page_changed(BDRVBlkcacheState *s, uint64_t page)
+{
+    uint64_t start = page * BLKCACHE_INDEX_PAGE_ENTRIES;
+
+    return find_next_bit(s->index_dirty, s->nb_blocks, start) <
+           start + BLKCACHE_INDEX_PAGE_ENTRIES;
+}
+
+/*
+ * Write the changed index entries to the other copy of the index on disk and
+ * switch the header to it.  Works both in and outside coroutine context; in
+ * a coroutine, the caller holds commit_lock.
+ */
+static int blkcache_commit_locked(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    const size_t page_size = BLKCACHE_INDEX_PAGE_SIZE;
+    uint64_t nb_pages = s->index_size / page_size;
+    uint64_t index_offset = blkcache_index_copy(s, s->generation + 1);
+    BlkcacheIndexEntry *pages;
+    uint64_t *page_numbers;
+    unsigned long *changed;
+    uint64_t n = 0, p, i;
+    int ret;
+
+    s->fills = 0;
+    if (find_first_bit(s->index_dirty, s->nb_blocks) >= s->nb_blocks) {
+        return 0;
+    }
+
+    /* Before the other copy is written, the header must point to this one */
+    if (s->header_dirty) {
+        ret = blkcache_write_header(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (p = 0; p < nb_pages; p++) {
+        if (blkcache_page_changed(s, p) || test_bit(p, s->index_stale)) {
+            n++;
+        }
+    }
+
+    trace_blkcache_commit(bs, n);
+
+    pages = qemu_try_blockalign(s->cache->bs, n * page_size);
+    if (!pages) {
+        return -ENOMEM;
+    }
+    page_numbers = g_new(uint64_t, n);
+    changed = bitmap_new(nb_pages);
+    memset(pages, 0, n * page_size);
+
+    /*
+     * Take the snapshot before flushing, so that the slot data and written
+     * back blocks it refers to are stable before the index is written.
+     * Slots that it records as used must not be reused while it is written.
+     * Pages that the last commit changed are copied as well, the other copy
+     * still has their old contents.
+     */
+    n = 0;
+    for (p = 0; p < nb_pages; p++) {
+        uint64_t start = p * BLKCACHE_INDEX_PAGE_ENTRIES;
+        uint64_t end = MIN(start + BLKCACHE_INDEX_PAGE_ENTRIES, s->nb_blocks);
+        BlkcacheIndexEntry *page = pages + n * BLKCACHE_INDEX_PAGE_ENTRIES;
+
+        if (blkcache_page_changed(s, p)) {
+            set_bit(p, changed);
+        } else if (!test_bit(p, s->index_stale)) {
+            continue;
+        }
+        page_numbers[n++] = p;
+
+        for (i = start; i < end; i++) {
+            BlkcacheSlot *slot = &s->slots[i];
+
+            clear_bit(i, s->index_dirty);
+            if (slot->valid) {
+                page[i - start].block = cpu_to_be64(slot->block);
+                page[i - start].flags = cpu_to_be32(BLKCACHE_ENTRY_VALID |
+                    (slot->dirty ? BLKCACHE_ENTRY_DIRTY : 0));
+                slot->committed = true;
+                slot->committed_dirty |= slot->dirty;
+            }
+        }
+    }
+
+    ret = bdrv_flush(s->cache->bs);
+    if (ret == 0 && !bdrv_is_read_only(bs)) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+
+    for (i = 0; i < n && ret >= 0; i++) {
+        ret = bdrv_pwrite(s->cache, index_offset + page_numbers[i] * page_size,
+                          pages + i * BLKCACHE_INDEX_PAGE_ENTRIES, page_size);
+    }
+    if (ret >= 0) {
+        ret = bdrv_flush(s->cache->bs);
+    }
+    if (ret >= 0) {
+        s->generation++;
+        ret = blkcache_write_header(bs);
+    }
+
+    if (ret < 0 && !s->header_dirty) {
+        for (p = 0; p < nb_pages; p++) {
+            if (test_bit(p, changed)) {
+                uint64_t start = p * BLKCACHE_INDEX_PAGE_ENTRIES;
+
+                bitmap_set(s->index_dirty, start,
+                           MIN(BLKCACHE_INDEX_PAGE_ENTRIES,
+                               s->nb_blocks - start));
+            }
+        }
+        goto out;
+    }
+
+    /*
+     * If only the header update failed, the header on disk points to either
+     * copy and both are complete.  The next commit rewrites the header
+     * before it overwrites the old copy; until then, the slots that the old
+     * copy refers to stay reserved.
+     */
+    bitmap_copy(s->index_stale, changed, nb_pages);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint64_t start = page_numbers[i] * BLKCACHE_INDEX_PAGE_ENTRIES;
+        uint64_t end = MIN(start + BLKCACHE_INDEX_PAGE_ENTRIES, s->nb_blocks);
+        BlkcacheIndexEntry *page = pages + i * BLKCACHE_INDEX_PAGE_ENTRIES;
+        uint64_t j;
+
+        for (j = start; j < end; j++) {
+            uint32_t flags = be32_to_cpu(page[j - start].flags);
+
+            s->slots[j].committed = !!flags;
+            s->slots[j].committed_dirty = !!(flags & BLKCACHE_ENTRY_DIRTY);
+        }
+    }
+
+out:
+    g_free(changed);
+    g_free(page_numbers);
+    qemu_vfree(pages);
+    return ret;
+}
+
+static int coroutine_fn blkcache_commit(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->commit_lock);
+    ret = blkcache_commit_locked(bs);
+    qemu_co_mutex_unlock(&s->commit_lock);
+    return ret;
+}
+
+/*
+ * Copy a dirty block to the origin.  Works both in and outside coroutine
+ * context; the caller makes sure that nothing else accesses the block.
+ */
+static int blkcache_write_back(BlockDriverState *bs, BlkcacheSlot *slot)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t bytes = blkcache_block_bytes(s, slot->block);
+    void *buf;
+    int ret;
+
+    trace_blkcache_write_back(bs, slot->block);
+
+    buf = qemu_try_blockalign(bs, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, blkcache_slot_offset(s, slot), buf, bytes);
+    if (ret >= 0) {
+        ret = bdrv_pwrite(bs->file, slot->block * s->block_size, buf, bytes);
+    }
+    qemu_vfree(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    slot->dirty = false;
+    s->dirty_blocks--;
+    blkcache_slot_changed(s, slot);
+    return 0;
+}
+
+static bool blkcache_can_write_back(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    return s->mode != BLKCACHE_MODE_READONLY && !bdrv_is_read_only(bs);
+}
+
+/*
+ * Find a free slot with the clock algorithm, evicting a block if needed.
+ * Returns the slot marked busy, or NULL if no slot can be freed now.
+ */
+static BlkcacheSlot *coroutine_fn blkcache_alloc_slot(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *pending_slot = NULL;
+    uint64_t pending = 0;
+    uint64_t i;
+
+    for (i = 0; i < 2 * s->nb_blocks; i++) {
+        BlkcacheSlot *slot = &s->slots[s->clock_hand];
+
+        s->clock_hand = (s->clock_hand + 1) % s->nb_blocks;
+
+        if (slot->busy) {
+            continue;
+        }
+        if (slot->valid) {
+            if (slot->referenced) {
+                slot->referenced = false;
+                continue;
+            }
+            if (blkcache_locked(s, slot->block, slot->block)) {
+                continue;
+            }
+            if (slot->dirty) {
+                BlkcacheReq req;
+                int ret;
+
+                if (!blkcache_can_write_back(bs)) {
+                    continue;
+                }
+
+                slot->busy = true;
+                blkcache_req_begin(s, &req, slot->block * s->block_size, 1);
+                ret = blkcache_write_back(bs, slot);
+                blkcache_req_end(&req);
+                slot->busy = false;
+                if (ret < 0) {
+                    continue;
+                }
+            }
+            trace_blkcache_evict(bs, slot->block);
+            blkcache_drop(s, slot);
+        }
+        if (!slot->committed) {
+            slot->busy = true;
+            return slot;
+        }
+
+        /*
+         * The index on disk still refers to the slot.  Evict a batch of
+         * such slots and commit once for all of them.
+         */
+        if (!pending_slot) {
+            pending_slot = slot;
+        }
+        if (++pending >= BLKCACHE_EVICT_BATCH(s)) {
+            break;
+        }
+    }
+
+    if (!pending_slot) {
+        return NULL;
+    }
+
+    pending_slot->busy = true;
+    if (blkcache_commit(bs) < 0 || pending_slot->committed) {
+        pending_slot->busy = false;
+        return NULL;
+    }
+    return pending_slot;
+}
+
+/* Copy a block read from the origin into the cache */
+static void coroutine_fn blkcache_fill(BlockDriverState *bs, uint64_t block,
+                                       void *buf, int64_t bytes)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *slot;
+    int ret;
+
+    slot = blkcache_alloc_slot(bs);
+    if (!slot) {
+        return;
+    }
+
+    trace_blkcache_fill(bs, block);
+    ret = bdrv_co_pwrite(s->cache, blkcache_slot_offset(s, slot), bytes, buf,
+                         0);
+    slot->busy = false;
+    if (ret < 0) {
+        return;
+    }
+
+    blkcache_insert(s, slot, block);
+    if (++s->fills >= BLKCACHE_COMMIT_FILLS) {
+        blkcache_commit(bs);
+    }
+}
+
+/*
+ * Split @offset/@bytes at block @block: returns the part of the request
+ * that lies in the block.
+ */
+static void blkcache_piece(BDRVBlkcacheState *s, uint64_t block,
+                           uint64_t offset, uint64_t bytes,
+                           uint64_t *piece_offset, uint64_t *piece_bytes)
+{
+    uint64_t start = MAX(offset, block * s->block_size);
+    uint64_t end = MIN(offset + bytes, (block + 1) * s->block_size);
+
+    *piece_offset = start;
+    *piece_bytes = end - start;
+}
+
+/* Read or write part of a cached block from or to @qiov */
+static int coroutine_fn blkcache_slot_io(BlockDriverState *bs,
+                                         BlkcacheSlot *slot,
+                                         uint64_t piece_offset,
+                                         uint64_t piece_bytes,
+                                         QEMUIOVector *qiov,
+                                         uint64_t qiov_offset, bool write)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t offset = blkcache_slot_offset(s, slot) +
+                      piece_offset - slot->block * s->block_size;
+    QEMUIOVector piece;
+    int ret;
+
+    qemu_iovec_init(&piece, qiov->niov);
+    qemu_iovec_concat(&piece, qiov, qiov_offset, piece_bytes);
+    if (write) {
+        ret = bdrv_co_pwritev(s->cache, offset, piece_bytes, &piece, 0);
+    } else {
+        ret = bdrv_co_preadv(s->cache, offset, piece_bytes, &piece, 0);
+    }
+    qemu_iovec_destroy(&piece);
+    return ret;
+}
+
+/* Read the uncached blocks [@first, @end) from the origin and cache them */
+static int coroutine_fn blkcache_read_miss(BlockDriverState *bs,
+                                           uint64_t first, uint64_t end,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t run_offset = first * s->block_size;
+    uint64_t run_bytes = MIN(end * s->block_size, s->size) - run_offset;
+    uint64_t piece_offset, piece_bytes;
+    uint64_t block;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(bs, run_bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, run_offset, run_bytes, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    piece_offset = MAX(offset, run_offset);
+    piece_bytes = MIN(offset + bytes, run_offset + run_bytes) - piece_offset;
+    qemu_iovec_from_buf(qiov, piece_offset - offset,
+                        buf + (piece_offset - run_offset), piece_bytes);
+
+    if (s->mode != BLKCACHE_MODE_READONLY) {
+        for (block = first; block < end; block++) {
+            blkcache_fill(bs, block, buf + (block - first) * s->block_size,
+                          blkcache_block_bytes(s, block));
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_preadv(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov, int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t max_run = MAX(BLKCACHE_MAX_MISS_BYTES / s->block_size, 1);
+    uint64_t block, end;
+    BlkcacheReq req;
+    int ret = 0;
+
+    blkcache_req_begin(s, &req, offset, bytes);
+
+    block = req.first;
+    while (block <= req.last) {
+        BlkcacheSlot *slot = blkcache_lookup(s, block);
+
+        if (slot) {
+            uint64_t piece_offset, piece_bytes;
+
+            blkcache_piece(s, block, offset, bytes, &piece_offset,
+                           &piece_bytes);
+            ret = blkcache_slot_io(bs, slot, piece_offset, piece_bytes, qiov,
+                                   piece_offset - offset, false);
+            if (ret < 0) {
+                break;
+            }
+            slot->referenced = true;
+            s->hits++;
+            block++;
+            continue;
+        }
+
+        end = block + 1;
+        while (end <= req.last && end - block < max_run &&
+               !blkcache_lookup(s, end)) {
+            end++;
+        }
+        s->misses += end - block;
+
+        ret = blkcache_read_miss(bs, block, end, offset, bytes, qiov);
+        if (ret < 0) {
+            break;
+        }
+        block = end;
+    }
+
+    blkcache_req_end(&req);
+    return ret;
+}
+
+/*
+ * Apply a write that went to the origin to the cached blocks it overlaps.
+ * @qiov is NULL for writing zeroes.
+ */
+static int coroutine_fn blkcache_update(BlockDriverState *bs, BlkcacheReq *req,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t block;
+    int ret;
+
+    for (block = req->first; block <= req->last; block++) {
+        BlkcacheSlot *slot = blkcache_lookup(s, block);
+        uint64_t piece_offset, piece_bytes;
+
+        if (!slot) {
+            continue;
+        }
+
+        blkcache_piece(s, block, offset, bytes, &piece_offset, &piece_bytes);
+        if (s->mode == BLKCACHE_MODE_READONLY ||
+            (!qiov && piece_bytes == blkcache_block_bytes(s, block))) {
+            blkcache_drop(s, slot);
+            continue;
+        }
+
+        /* Zeroes in writeback mode; the committed data must stay intact */
+        if (slot->committed_dirty) {
+            ret = blkcache_write_back(bs, slot);
+            if (ret < 0) {
+                return ret;
+            }
+            blkcache_drop(s, slot);
+            continue;
+        }
+
+        if (qiov) {
+            ret = blkcache_slot_io(bs, slot, piece_offset, piece_bytes, qiov,
+                                   piece_offset - offset, true);
+        } else {
+            ret = bdrv_co_pwrite_zeroes(s->cache,
+                                        blkcache_slot_offset(s, slot) +
+                                        piece_offset - block * s->block_size,
+                                        piece_bytes, 0);
+        }
+        if (ret < 0) {
+            /* A dirty block has data the origin lacks, it cannot be dropped */
+            if (slot->dirty) {
+                return ret;
+            }
+            blkcache_drop(s, slot);
+        }
+    }
+
+    return 0;
+}
+
+/* Copy the data of @from into @to, which is not in use yet */
+static int coroutine_fn blkcache_copy_slot(BlockDriverState *bs,
+                                           BlkcacheSlot *from,
+                                           BlkcacheSlot *to)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t bytes = blkcache_block_bytes(s, from->block);
+    void *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(s->cache->bs, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(s->cache, blkcache_slot_offset(s, from), bytes, buf,
+                        0);
+    if (ret >= 0) {
+        ret = bdrv_co_pwrite(s->cache, blkcache_slot_offset(s, to), bytes,
+                             buf, 0);
+    }
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_pwritev_back(BlockDriverState *bs,
+                                                 BlkcacheReq *req,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t block;
+    int ret = 0;
+
+    for (block = req->first; block <= req->last; block++) {
+        BlkcacheSlot *slot = blkcache_lookup(s, block);
+        BlkcacheSlot *new_slot = NULL;
+        uint64_t piece_offset, piece_bytes;
+
+        blkcache_piece(s, block, offset, bytes, &piece_offset, &piece_bytes);
+
+        /*
+         * Allocate for whole blocks only, partial ones would need a read.
+         * Dirty data that the index on disk refers to is not overwritten,
+         * the write goes to a copy in a new slot instead.
+         */
+        if ((!slot && piece_bytes == blkcache_block_bytes(s, block)) ||
+            (slot && slot->committed_dirty)) {
+            new_slot = blkcache_alloc_slot(bs);
+        }
+
+        if (slot && slot->committed_dirty && !new_slot) {
+            ret = blkcache_write_back(bs, slot);
+            if (ret < 0) {
+                break;
+            }
+            blkcache_drop(s, slot);
+            slot = NULL;
+        }
+
+        if (!slot && !new_slot) {
+            QEMUIOVector piece;
+
+            qemu_iovec_init(&piece, qiov->niov);
+            qemu_iovec_concat(&piece, qiov, piece_offset - offset,
+                              piece_bytes);
+            ret = bdrv_co_pwritev(bs->file, piece_offset, piece_bytes,
+                                  &piece, flags);
+            qemu_iovec_destroy(&piece);
+            if (ret < 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (new_slot) {
+            new_slot->block = block;
+            if (slot) {
+                trace_blkcache_shadow(bs, block);
+                if (piece_bytes < blkcache_block_bytes(s, block)) {
+                    ret = blkcache_copy_slot(bs, slot, new_slot);
+                }
+            }
+            if (ret >= 0) {
+                ret = blkcache_slot_io(bs, new_slot, piece_offset,
+                                       piece_bytes, qiov,
+                                       piece_offset - offset, true);
+            }
+            new_slot->busy = false;
+            if (ret < 0) {
+                break;
+            }
+            if (slot) {
+                blkcache_drop(s, slot);
+            }
+            blkcache_insert(s, new_slot, block);
+            slot = new_slot;
+        } else {
+            ret = blkcache_slot_io(bs, slot, piece_offset, piece_bytes, qiov,
+                                   piece_offset - offset, true);
+            if (ret < 0) {
+                break;
+            }
+        }
+        slot->referenced = true;
+        blkcache_set_dirty(s, slot);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_pwritev(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheReq req;
+    int ret;
+
+    blkcache_req_begin(s, &req, offset, bytes);
+    if (s->mode == BLKCACHE_MODE_WRITEBACK) {
+        /* The commit below makes the whole request stable */
+        ret = blkcache_co_pwritev_back(bs, &req, offset, bytes, qiov,
+                                       flags & ~BDRV_REQ_FUA);
+        if (ret == 0 && (flags & BDRV_REQ_FUA)) {
+            ret = blkcache_commit(bs);
+        }
+    } else {
+        ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+        if (ret == 0) {
+            ret = blkcache_update(bs, &req, offset, bytes, qiov);
+        }
+    }
+    blkcache_req_end(&req);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                  int64_t offset, int bytes,
+                                                  BdrvRequestFlags flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheReq req;
+    int ret;
+
+    blkcache_req_begin(s, &req, offset, bytes);
+    ret = blkcache_update(bs, &req, offset, bytes, NULL);
+    if (ret == 0) {
+        ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    }
+    /* The index on disk may still refer to older data of the blocks */
+    if (ret == 0 && (flags & BDRV_REQ_FUA) &&
+        s->mode == BLKCACHE_MODE_WRITEBACK) {
+        ret = blkcache_commit(bs);
+    }
+    blkcache_req_end(&req);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_pdiscard(BlockDriverState *bs,
+                                             int64_t offset, int bytes)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheReq req;
+    uint64_t block;
+    int ret;
+
+    blkcache_req_begin(s, &req, offset, bytes);
+
+    /* Partially discarded blocks keep their data, which is allowed */
+    for (block = req.first; block <= req.last; block++) {
+        BlkcacheSlot *slot = blkcache_lookup(s, block);
+        uint64_t piece_offset, piece_bytes;
+
+        blkcache_piece(s, block, offset, bytes, &piece_offset, &piece_bytes);
+        if (slot && piece_bytes == blkcache_block_bytes(s, block)) {
+            blkcache_drop(s, slot);
+        }
+    }
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+
+    blkcache_req_end(&req);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_flush(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (s->mode == BLKCACHE_MODE_READONLY) {
+        return bdrv_co_flush(bs->file->bs);
+    }
+
+    /* Flushes the origin as well */
+    return blkcache_commit(bs);
+}
+
+static int coroutine_fn blkcache_co_block_status(BlockDriverState *bs,
+                                                 bool want_zero,
+                                                 int64_t offset,
+                                                 int64_t bytes,
+                                                 int64_t *pnum,
+                                                 int64_t *map,
+                                                 BlockDriverState **file)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    /* The origin does not know about dirty blocks */
+    if (s->dirty_blocks) {
+        *pnum = bytes;
+        return BDRV_BLOCK_DATA;
+    }
+
+    return bdrv_co_block_status_from_file(bs, want_zero, offset, bytes,
+                                          pnum, map, file);
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    return s->size;
+}
+
+/* Create an empty cache in the cache child */
+static int blkcache_format(BlockDriverState *bs, QemuOpts *opts, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t block_size, cache_size;
+    int ret;
+
+    block_size = qemu_opt_get_size(opts, "block-size",
+                                   BLKCACHE_DEFAULT_BLOCK_SIZE);
+    if (!is_power_of_2(block_size) || block_size < BLKCACHE_MIN_BLOCK_SIZE ||
+        block_size > BLKCACHE_MAX_BLOCK_SIZE) {
+        error_setg(errp, "block-size must be a power of two between %d KiB "
+                   "and %d MiB", BLKCACHE_MIN_BLOCK_SIZE / KiB,
+                   BLKCACHE_MAX_BLOCK_SIZE / MiB);
+        return -EINVAL;
+    }
+
+    cache_size = qemu_opt_get_size(opts, "cache-size",
+                                   BLKCACHE_DEFAULT_CACHE_SIZE);
+    if (cache_size < block_size ||
+        cache_size / block_size > BLKCACHE_MAX_BLOCKS) {
+        error_setg(errp, "cache-size must hold between 1 and %d blocks",
+                   BLKCACHE_MAX_BLOCKS);
+        return -EINVAL;
+    }
+
+    s->block_size = block_size;
+    s->nb_blocks = cache_size / block_size;
+    s->index_offset = BLKCACHE_HEADER_SIZE;
+    s->index_size = blkcache_index_size(s->nb_blocks);
+    s->data_offset = ROUND_UP(s->index_offset + 2 * s->index_size,
+                              block_size);
+    s->generation = 0;
+    s->header_flags = 0;
+
+    ret = bdrv_truncate(s->cache, s->data_offset + s->nb_blocks * block_size,
+                        PREALLOC_MODE_OFF, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_pwrite_zeroes(s->cache, 0, s->data_offset, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not initialize the cache index");
+        return ret;
+    }
+
+    ret = blkcache_write_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+    return 0;
+}
+
+static int blkcache_load(BlockDriverState *bs, int64_t cache_len,
+                         QemuOpts *opts, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheHeader header;
+    BlkcacheIndexEntry *index;
+    uint64_t index_bytes, i;
+    int ret;
+
+    ret = bdrv_pread(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        return ret;
+    }
+
+    if (be64_to_cpu(header.magic) != BLKCACHE_MAGIC) {
+        error_setg(errp, "The cache file does not contain a cache");
+        return -EINVAL;
+    }
+    if (be32_to_cpu(header.version) != BLKCACHE_VERSION) {
+        error_setg(errp, "Unsupported cache version %" PRIu32,
+                   be32_to_cpu(header.version));
+        return -ENOTSUP;
+    }
+
+    s->header_flags = be32_to_cpu(header.flags);
+    s->block_size = be32_to_cpu(header.block_size);
+    s->nb_blocks = be64_to_cpu(header.nb_blocks);
+    s->index_offset = be64_to_cpu(header.index_offset);
+    s->data_offset = be64_to_cpu(header.data_offset);
+    s->generation = be64_to_cpu(header.generation);
+
+    if (!is_power_of_2(s->block_size) ||
+        s->block_size < BLKCACHE_MIN_BLOCK_SIZE ||
+        s->block_size > BLKCACHE_MAX_BLOCK_SIZE ||
+        s->nb_blocks == 0 || s->nb_blocks > BLKCACHE_MAX_BLOCKS ||
+        s->index_offset < BLKCACHE_HEADER_SIZE ||
+        s->data_offset < s->index_offset +
+                         2 * blkcache_index_size(s->nb_blocks)) {
+        error_setg(errp, "The cache header is corrupt");
+        return -EINVAL;
+    }
+
+    if (s->data_offset > cache_len ||
+        cache_len - s->data_offset < s->nb_blocks * s->block_size) {
+        error_setg(errp, "The cache file is truncated");
+        return -EINVAL;
+    }
+
+    if (qemu_opt_get_size(opts, "block-size", s->block_size) !=
+        s->block_size ||
+        qemu_opt_get_size(opts, "cache-size", s->nb_blocks * s->block_size) !=
+        s->nb_blocks * s->block_size) {
+        error_setg(errp, "block-size and cache-size do not match the "
+                   "existing cache");
+        return -EINVAL;
+    }
+
+    header.origin[sizeof(header.origin) - 1] = '\0';
+    if (strncmp(header.origin, bs->file->bs->exact_filename,
+                sizeof(header.origin) - 1)) {
+        error_setg(errp, "The cache belongs to '%s', not '%s'",
+                   header.origin, bs->file->bs->exact_filename);
+        return -EINVAL;
+    }
+
+    if (be64_to_cpu(header.origin_size) != s->size) {
+        error_setg(errp, "The cache belongs to an image of %" PRIu64
+                   " bytes, not %" PRId64, be64_to_cpu(header.origin_size),
+                   s->size);
+        return -EINVAL;
+    }
+
+    if (s->mode == BLKCACHE_MODE_READONLY &&
+        (s->header_flags & BLKCACHE_HF_OPEN)) {
+        error_setg(errp, "The cache was not closed cleanly; open it "
+                   "read-write once to recover it");
+        return -EINVAL;
+    }
+
+    s->index_size = blkcache_index_size(s->nb_blocks);
+    index_bytes = s->nb_blocks * sizeof(BlkcacheIndexEntry);
+    index = g_try_malloc(index_bytes);
+    if (!index) {
+        error_setg(errp, "Could not allocate the cache index");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, blkcache_index_copy(s, s->generation), index,
+                     index_bytes);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache index");
+        goto out;
+    }
+
+    s->slots = g_new0(BlkcacheSlot, s->nb_blocks);
+    s->index_dirty = bitmap_new(s->nb_blocks);
+    s->index_stale = bitmap_new(s->index_size / BLKCACHE_INDEX_PAGE_SIZE);
+    for (i = 0; i < s->nb_blocks; i++) {
+        BlkcacheSlot *slot = &s->slots[i];
+        uint32_t flags = be32_to_cpu(index[i].flags);
+        uint64_t block = be64_to_cpu(index[i].block);
+
+        if (!(flags & BLKCACHE_ENTRY_VALID)) {
+            continue;
+        }
+        if (block >= DIV_ROUND_UP(s->size, s->block_size) ||
+            blkcache_lookup(s, block)) {
+            error_setg(errp, "The cache index is corrupt");
+            ret = -EINVAL;
+            goto out;
+        }
+
+        blkcache_insert(s, slot, block);
+        slot->committed = true;
+        if (flags & BLKCACHE_ENTRY_DIRTY) {
+            slot->dirty = true;
+            slot->committed_dirty = true;
+            s->dirty_blocks++;
+        }
+    }
+    bitmap_zero(s->index_dirty, s->nb_blocks);
+
+    /* Nothing is known about the other copy, the next commit rewrites it */
+    bitmap_set(s->index_stale, 0, s->index_size / BLKCACHE_INDEX_PAGE_SIZE);
+    ret = 0;
+
+out:
+    g_free(index);
+    return ret;
+}
+
+/* Forget all clean blocks, the origin may have changed behind our back */
+static void blkcache_drop_clean(BDRVBlkcacheState *s)
+{
+    uint64_t i;
+
+    for (i = 0; i < s->nb_blocks; i++) {
+        if (s->slots[i].valid && !s->slots[i].dirty) {
+            blkcache_drop(s, &s->slots[i]);
+        }
+    }
+}
+
+/*
+ * Start using a read-write cache: write back the dirty blocks in
+ * writethrough mode and mark the cache as open.  Works both in and outside
+ * coroutine context; in a coroutine, the caller holds commit_lock.
+ */
+static int blkcache_activate(BlockDriverState *bs, bool drop_clean,
+                             Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t i;
+    int ret;
+
+    if (drop_clean) {
+        blkcache_drop_clean(s);
+    }
+
+    /* The origin is up to date in writethrough mode */
+    if (s->mode == BLKCACHE_MODE_WRITETHROUGH && !bdrv_is_read_only(bs)) {
+        for (i = 0; i < s->nb_blocks && s->dirty_blocks; i++) {
+            if (s->slots[i].dirty) {
+                ret = blkcache_write_back(bs, &s->slots[i]);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "Could not write back the "
+                                     "cache");
+                    return ret;
+                }
+            }
+        }
+    }
+
+    ret = blkcache_commit_locked(bs);
+    if (ret == 0) {
+        s->header_flags |= BLKCACHE_HF_OPEN;
+        ret = blkcache_write_header(bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the cache");
+        return ret;
+    }
+    return 0;
+}
+
+/* Commit the index and record that the cache was closed cleanly */
+static int blkcache_mark_clean(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    ret = blkcache_commit_locked(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    s->header_flags &= ~BLKCACHE_HF_OPEN;
+    return blkcache_write_header(bs);
+}
+
+static int blkcache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int64_t cache_len;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->mode = qapi_enum_parse(&BlkcacheMode_lookup,
+                              qemu_opt_get(opts, "mode"),
+                              BLKCACHE_MODE_WRITETHROUGH, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QLIST_INIT(&s->reqs);
+    qemu_co_mutex_init(&s->commit_lock);
+
+    /* Open the origin */
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP) &
+            bs->file->bs->supported_zero_flags);
+
+    /* Open the cache */
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs,
+                               &child_blkcache, false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->size = bdrv_getlength(bs->file->bs);
+    if (s->size < 0) {
+        ret = s->size;
+        error_setg_errno(errp, -ret, "Could not get the image size");
+        goto fail_cache;
+    }
+
+    cache_len = bdrv_getlength(s->cache->bs);
+    if (cache_len < 0) {
+        ret = cache_len;
+        error_setg_errno(errp, -ret, "Could not get the cache size");
+        goto fail_cache;
+    }
+
+    if (cache_len == 0) {
+        if (s->mode == BLKCACHE_MODE_READONLY) {
+            ret = -EINVAL;
+            error_setg(errp, "The cache file is empty");
+            goto fail_cache;
+        }
+        ret = blkcache_format(bs, opts, errp);
+        if (ret < 0) {
+            goto fail_cache;
+        }
+        s->slots = g_new0(BlkcacheSlot, s->nb_blocks);
+        s->index_dirty = bitmap_new(s->nb_blocks);
+        s->index_stale = bitmap_new(s->index_size / BLKCACHE_INDEX_PAGE_SIZE);
+    } else {
+        ret = blkcache_load(bs, cache_len, opts, errp);
+        if (ret < 0) {
+            goto fail_cache;
+        }
+    }
+
+    if (s->mode == BLKCACHE_MODE_READONLY) {
+        if (s->dirty_blocks) {
+            ret = -EINVAL;
+            error_setg(errp, "The cache has %" PRIu64 " dirty blocks; open it "
+                       "in writethrough mode once to write them back",
+                       s->dirty_blocks);
+            goto fail_cache;
+        }
+        ret = 0;
+        goto out;
+    }
+
+    /* Incoming migration; blkcache_co_invalidate_cache() takes over */
+    if (flags & BDRV_O_INACTIVE) {
+        ret = 0;
+        goto out;
+    }
+
+    /*
+     * After a crash, clean blocks may be torn or older than the origin.
+     * Dirty blocks are intact because they are never written in place.
+     */
+    ret = blkcache_activate(bs, s->header_flags & BLKCACHE_HF_OPEN, errp);
+    if (ret < 0) {
+        goto fail_cache;
+    }
+    goto out;
+
+fail_cache:
+    bdrv_unref_child(bs, s->cache);
+    s->cache = NULL;
+fail:
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+        s->map = NULL;
+    }
+    g_free(s->slots);
+    s->slots = NULL;
+    g_free(s->index_dirty);
+    s->index_dirty = NULL;
+    g_free(s->index_stale);
+    s->index_stale = NULL;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+/*
+ * Another host takes over the origin, e.g. at the end of a migration.  It
+ * does not know about the dirty blocks, so they must reach the origin first.
+ * The node is drained, so no request can touch the cache.
+ */
+static int blkcache_inactivate(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t i;
+    int ret;
+
+    if (s->mode == BLKCACHE_MODE_READONLY) {
+        return 0;
+    }
+
+    if (s->dirty_blocks && !blkcache_can_write_back(bs)) {
+        error_report("Cannot inactivate node '%s': the cache has %" PRIu64
+                     " dirty blocks that cannot be written back",
+                     bdrv_get_device_or_node_name(bs), s->dirty_blocks);
+        return -EBUSY;
+    }
+
+    for (i = 0; i < s->nb_blocks && s->dirty_blocks; i++) {
+        if (s->slots[i].dirty) {
+            ret = blkcache_write_back(bs, &s->slots[i]);
+            if (ret < 0) {
+                error_report("Failed to write back the cache of node '%s': %s",
+                             bdrv_get_device_or_node_name(bs), strerror(-ret));
+                return ret;
+            }
+        }
+    }
+
+    ret = blkcache_mark_clean(bs);
+    if (ret < 0) {
+        error_report("Failed to update the cache of node '%s': %s",
+                     bdrv_get_device_or_node_name(bs), strerror(-ret));
+    }
+    return ret;
+}
+
+/*
+ * The node becomes active after an incoming migration, or again after a
+ * failed outgoing one.  In both cases, another host may have written to the
+ * origin in the meantime.
+ */
+static void coroutine_fn blkcache_co_invalidate_cache(BlockDriverState *bs,
+                                                      Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (s->mode == BLKCACHE_MODE_READONLY) {
+        /* The cache file cannot be changed, only forget the blocks */
+        blkcache_drop_clean(s);
+        return;
+    }
+
+    qemu_co_mutex_lock(&s->commit_lock);
+    blkcache_activate(bs, true, errp);
+    qemu_co_mutex_unlock(&s->commit_lock);
+}
+
+/* The node is drained, so no request can touch the cache */
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (s->mode != BLKCACHE_MODE_READONLY &&
+        !(bs->open_flags & BDRV_O_INACTIVE)) {
+        blkcache_mark_clean(bs);
+    }
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    g_free(s->index_dirty);
+    g_free(s->index_stale);
+
+    bdrv_unref_child(bs, s->cache);
+    s->cache = NULL;
+}
+
+static void blkcache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                const BdrvChildRole *role,
+                                BlockReopenQueue *ro_q,
+                                uint64_t perm, uint64_t shared,
+                                uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (c && !strcmp(c->name, "cache-file")) {
+        if (s->mode == BLKCACHE_MODE_READONLY ||
+            (bs->open_flags & BDRV_O_INACTIVE)) {
+            /* Other users may read the cache, but not change it */
+            *nperm = BLK_PERM_CONSISTENT_READ;
+            *nshared = BLK_PERM_ALL & ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+        } else {
+            *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE |
+                     BLK_PERM_RESIZE;
+            *nshared = BLK_PERM_WRITE_UNCHANGED;
+        }
+        return;
+    }
+
+    bdrv_filter_default_perms(bs, c, role, ro_q, perm, shared, nperm, nshared);
+
+    /* Dirty blocks are written back even when no parent writes */
+    if (c && s->mode != BLKCACHE_MODE_READONLY && bdrv_is_writable(bs)) {
+        *nperm |= BLK_PERM_WRITE;
+    }
+}
+
+/*
+ * The cache is updated by reads as well, so unless it is used read-only
+ * it stays writable below a read-only parent.
+ */
+static void blkcache_cache_inherit_options(int *child_flags,
+                                           QDict *child_options,
+                                           int parent_flags,
+                                           QDict *parent_options)
+{
+    const char *mode = qdict_get_try_str(parent_options, "mode");
+
+    qdict_set_default_str(child_options, BDRV_OPT_READ_ONLY,
+                          g_strcmp0(mode, "readonly") ? "off" : "on");
+    child_file.inherit_options(child_flags, child_options,
+                               parent_flags, parent_options);
+}
+
+/* Options that are left out keep their value */
+static int blkcache_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    BDRVBlkcacheState *s = reopen_state->bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    BlkcacheMode mode;
+    int ret = -EINVAL;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, reopen_state->options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    mode = qapi_enum_parse(&BlkcacheMode_lookup, qemu_opt_get(opts, "mode"),
+                           s->mode, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+    if (mode != s->mode) {
+        error_setg(errp, "Cannot change the mode of a blkcache node");
+        goto out;
+    }
+
+    if (qemu_opt_get_size(opts, "block-size", s->block_size) !=
+        s->block_size ||
+        qemu_opt_get_size(opts, "cache-size", s->nb_blocks * s->block_size) !=
+        s->nb_blocks * s->block_size) {
+        error_setg(errp, "Cannot change block-size or cache-size of an "
+                   "existing cache");
+        goto out;
+    }
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static BlockStatsSpecific *blkcache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+    BlockStatsSpecificBlkcache *bc_stats = &stats->u.blkcache;
+
+    stats->driver = BLOCKDEV_DRIVER_BLKCACHE;
+    bc_stats->block_size = s->block_size;
+    bc_stats->blocks = s->nb_blocks;
+    bc_stats->used_blocks = s->used_blocks;
+    bc_stats->dirty_blocks = s->dirty_blocks;
+    bc_stats->hits = s->hits;
+    bc_stats->misses = s->misses;
+
+    return stats;
+}
+
+static bool blkcache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                 BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static const char *const blkcache_strong_runtime_opts[] = {
+    "mode",
+    "cache-size",
+    "block-size",
+
+    NULL
+};
+
+static BlockDriver bdrv_blkcache = {
+    .format_name                        = "blkcache",
+    .instance_size                      = sizeof(BDRVBlkcacheState),
+
+    .bdrv_open                          = blkcache_open,
+    .bdrv_close                         = blkcache_close,
+    .bdrv_child_perm                    = blkcache_child_perm,
+    .bdrv_reopen_prepare                = blkcache_reopen_prepare,
+    .bdrv_inactivate                    = blkcache_inactivate,
+    .bdrv_co_invalidate_cache           = blkcache_co_invalidate_cache,
+
+    .bdrv_getlength                     = blkcache_getlength,
+
+    .bdrv_co_preadv                     = blkcache_co_preadv,
+    .bdrv_co_pwritev                    = blkcache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = blkcache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = blkcache_co_pdiscard,
+    .bdrv_co_flush                      = blkcache_co_flush,
+
+    .bdrv_co_block_status               = blkcache_co_block_status,
+    .bdrv_get_specific_stats            = blkcache_get_specific_stats,
+
+    .bdrv_recurse_is_first_non_filter   = blkcache_recurse_is_first_non_filter,
+
+    .is_filter                          = true,
+    .strong_runtime_opts                = blkcache_strong_runtime_opts,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    child_blkcache = child_file;
+    child_blkcache.inherit_options = blkcache_cache_inherit_options;
+
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
@@ -1127,6 +1127,13 @@ static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+static void blk_account_stage(BlockBackend *blk, enum BlockAcctStage stage,
+                              enum BlockAcctType type, int64_t start_ns)
+{
+    block_latency_log_account(&blk->stats.stage_latency[stage][type],
+                              start_ns);
+}
+
 int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
                                unsigned int bytes, QEMUIOVector *qiov,
                                BdrvRequestFlags flags)
@@ -1145,8 +1152,12 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
 
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
+        int64_t start_ns = block_acct_clock_ns();
+
         throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
                 bytes, false);
+        blk_account_stage(blk, BLOCK_ACCT_STAGE_THROTTLE, BLOCK_ACCT_READ,
+                          start_ns);
     }
 
     ret = bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
@@ -1171,8 +1182,12 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
     bdrv_inc_in_flight(bs);
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
+        int64_t start_ns = block_acct_clock_ns();
+
         throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
                 bytes, true);
+        blk_account_stage(blk, BLOCK_ACCT_STAGE_THROTTLE, BLOCK_ACCT_WRITE,
+                          start_ns);
     }
 
     if (!blk->enable_write_cache) {
@@ -1305,6 +1320,7 @@ typedef struct BlkAioEmAIOCB {
     BlkRwCo rwco;
     int bytes;
     bool has_returned;
+    int64_t submit_ns;
 } BlkAioEmAIOCB;
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
@@ -1346,6 +1362,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     };
     acb->bytes = bytes;
     acb->has_returned = false;
+    acb->submit_ns = block_acct_clock_ns();
 
     co = qemu_coroutine_create(co_entry, acb);
     bdrv_coroutine_enter(blk_bs(blk), co);
@@ -1359,12 +1376,20 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     return &acb->common;
 }
 
+/* Account the time between submission and the coroutine starting to run */
+static void blk_aio_account_queue(BlkAioEmAIOCB *acb, enum BlockAcctType type)
+{
+    blk_account_stage(acb->rwco.blk, BLOCK_ACCT_STAGE_QUEUE, type,
+                      acb->submit_ns);
+}
+
 static void blk_aio_read_entry(void *opaque)
 {
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
     QEMUIOVector *qiov = rwco->iobuf;
 
+    blk_aio_account_queue(acb, BLOCK_ACCT_READ);
     assert(qiov->size == acb->bytes);
     rwco->ret = blk_co_preadv(rwco->blk, rwco->offset, acb->bytes,
                               qiov, rwco->flags);
@@ -1377,6 +1402,7 @@ static void blk_aio_write_entry(void *opaque)
     BlkRwCo *rwco = &acb->rwco;
     QEMUIOVector *qiov = rwco->iobuf;
 
+    blk_aio_account_queue(acb, BLOCK_ACCT_WRITE);
     assert(!qiov || qiov->size == acb->bytes);
     rwco->ret = blk_co_pwritev(rwco->blk, rwco->offset, acb->bytes,
                                qiov, rwco->flags);
@@ -1459,6 +1485,7 @@ static void blk_aio_flush_entry(void *opaque)
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
 
+    blk_aio_account_queue(acb, BLOCK_ACCT_FLUSH);
     rwco->ret = blk_co_flush(rwco->blk);
     blk_aio_complete(acb);
 }
@@ -2280,6 +2307,28 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+int coroutine_fn blk_co_splice_read(BlockBackend *blk, int64_t offset,
+                                    unsigned int bytes, int pipe_fd)
+{
+    int ret;
+    BlockDriverState *bs = blk_bs(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs);
+    if (bytes && blk->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                bytes, false);
+    }
+
+    ret = bdrv_co_splice_read(blk->root, offset, bytes, pipe_fd);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
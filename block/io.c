@@ -38,6 +38,42 @@
 /* Maximum bounce buffer for copy-on-read and write zeroes, in bytes */
 #define MAX_BOUNCE_BUFFER (32768 << BDRV_SECTOR_BITS)
 
+int coroutine_fn bdrv_co_splice_read(BdrvChild *child, int64_t offset,
+                                     unsigned int bytes, int pipe_fd)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bs || !bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Copy-on-read needs the data in a buffer to write it back */
+    if (!bs->drv->bdrv_co_splice_read || bs->encrypted ||
+        atomic_read(&bs->copy_on_read)) {
+        return -ENOTSUP;
+    }
+    if (!bytes) {
+        return bs->drv->bdrv_co_splice_read(bs, offset, 0, pipe_fd);
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_splice_read(bs, offset, bytes, pipe_fd);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs);
 static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags);
@@ -978,9 +1014,9 @@ static void bdrv_co_io_em_complete(void *opaque, int ret)
     aio_co_wake(co->coroutine);
 }
 
-static int coroutine_fn bdrv_driver_preadv(BlockDriverState *bs,
-                                           uint64_t offset, uint64_t bytes,
-                                           QEMUIOVector *qiov, int flags)
+static int coroutine_fn bdrv_driver_do_preadv(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
 {
     BlockDriver *drv = bs->drv;
     int64_t sector_num;
@@ -1024,9 +1060,9 @@ static int coroutine_fn bdrv_driver_preadv(BlockDriverState *bs,
     return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
 }
 
-static int coroutine_fn bdrv_driver_pwritev(BlockDriverState *bs,
-                                            uint64_t offset, uint64_t bytes,
-                                            QEMUIOVector *qiov, int flags)
+static int coroutine_fn bdrv_driver_do_pwritev(BlockDriverState *bs,
+                                               uint64_t offset, uint64_t bytes,
+                                               QEMUIOVector *qiov, int flags)
 {
     BlockDriver *drv = bs->drv;
     int64_t sector_num;
@@ -1086,11 +1122,37 @@ emulate_flags:
     return ret;
 }
 
+static int coroutine_fn bdrv_driver_preadv(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov, int flags)
+{
+    int64_t start_ns = block_acct_clock_ns();
+    int ret;
+
+    ret = bdrv_driver_do_preadv(bs, offset, bytes, qiov, flags);
+    block_latency_log_account(&bs->driver_latency[BLOCK_ACCT_READ], start_ns);
+    return ret;
+}
+
+static int coroutine_fn bdrv_driver_pwritev(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    int64_t start_ns = block_acct_clock_ns();
+    int ret;
+
+    ret = bdrv_driver_do_pwritev(bs, offset, bytes, qiov, flags);
+    block_latency_log_account(&bs->driver_latency[BLOCK_ACCT_WRITE], start_ns);
+    return ret;
+}
+
 static int coroutine_fn
 bdrv_driver_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
                                uint64_t bytes, QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
+    int64_t start_ns;
+    int ret;
 
     if (!drv) {
         return -ENOMEDIUM;
@@ -1100,7 +1162,10 @@ bdrv_driver_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
         return -ENOTSUP;
     }
 
-    return drv->bdrv_co_pwritev_compressed(bs, offset, bytes, qiov);
+    start_ns = block_acct_clock_ns();
+    ret = drv->bdrv_co_pwritev_compressed(bs, offset, bytes, qiov);
+    block_latency_log_account(&bs->driver_latency[BLOCK_ACCT_WRITE], start_ns);
+    return ret;
 }
 
 static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
@@ -1360,6 +1425,7 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     uint8_t *tail_buf = NULL;
     QEMUIOVector local_qiov;
     bool use_local_qiov = false;
+    int64_t start_ns;
     int ret;
 
     trace_bdrv_co_preadv(child->bs, offset, bytes, flags);
@@ -1374,6 +1440,7 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = block_acct_clock_ns();
 
     /* Don't do copy-on-read if we read data before write operation */
     if (atomic_read(&bs->copy_on_read) && !(flags & BDRV_REQ_NO_SERIALISING)) {
@@ -1410,6 +1477,7 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
                               use_local_qiov ? &local_qiov : qiov,
                               flags);
     tracked_request_end(&req);
+    block_latency_log_account(&bs->request_latency[BLOCK_ACCT_READ], start_ns);
     bdrv_dec_in_flight(bs);
 
     if (use_local_qiov) {
@@ -1803,6 +1871,7 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     uint8_t *tail_buf = NULL;
     QEMUIOVector local_qiov;
     bool use_local_qiov = false;
+    int64_t start_ns;
     int ret;
 
     trace_bdrv_co_pwritev(child->bs, offset, bytes, flags);
@@ -1817,6 +1886,7 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = block_acct_clock_ns();
     /*
      * Align write if necessary by performing a read-modify-write cycle.
      * Pad qiov with the read parts and be sure to have a tracked request not
@@ -1908,6 +1978,7 @@ fail:
     qemu_vfree(tail_buf);
 out:
     tracked_request_end(&req);
+    block_latency_log_account(&bs->request_latency[BLOCK_ACCT_WRITE], start_ns);
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -2500,6 +2571,7 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
     int current_gen;
+    int64_t start_ns, driver_start_ns;
     int ret = 0;
 
     bdrv_inc_in_flight(bs);
@@ -2509,6 +2581,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto early_exit;
     }
 
+    start_ns = block_acct_clock_ns();
     qemu_co_mutex_lock(&bs->reqs_lock);
     current_gen = atomic_read(&bs->write_gen);
 
@@ -2520,6 +2593,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     /* Flushes reach this point in nondecreasing current_gen order.  */
     bs->active_flush_req = true;
     qemu_co_mutex_unlock(&bs->reqs_lock);
+    driver_start_ns = block_acct_clock_ns();
 
     /* Write back all layers by calling one driver function */
     if (bs->drv->bdrv_co_flush) {
@@ -2593,6 +2667,9 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 flush_parent:
     ret = bs->file ? bdrv_co_flush(bs->file->bs) : 0;
 out:
+    /* Like for reads and writes, the driver stage includes the child nodes */
+    block_latency_log_account(&bs->driver_latency[BLOCK_ACCT_FLUSH],
+                              driver_start_ns);
     /* Notify any pending flushes that we have completed */
     if (ret == 0) {
         bs->flushed_gen = current_gen;
@@ -2603,6 +2680,7 @@ out:
     /* Return value is ignored - it's ok if wait queue is empty */
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
+    block_latency_log_account(&bs->request_latency[BLOCK_ACCT_FLUSH], start_ns);
 
 early_exit:
     bdrv_dec_in_flight(bs);
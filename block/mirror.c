@@ -28,6 +28,9 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Minimum number of completed copy operations to adapt the copy window */
+#define MIRROR_ADAPT_MIN_OPS 4
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -77,6 +80,20 @@ typedef struct MirrorBlockJob {
     bool unmap;
     int target_cluster_size;
     int max_iov;
+
+    /* Copy window, adapted to the target by mirror_adapt() */
+    int max_in_flight;
+    int64_t chunk_size;
+    int64_t max_chunk_size;
+    bool window_full;
+    int64_t adapt_start_ns;
+    int64_t adapt_bytes;
+    int64_t adapt_latency_ns;
+    int adapt_ops;
+    uint64_t base_latency_ns;
+    uint64_t latency_ns;
+    uint64_t bandwidth;
+
     bool initial_zeroing_ongoing;
     int in_active_write_counter;
     bool prepared;
@@ -102,6 +119,9 @@ struct MirrorOp {
     bool is_active_write;
     CoQueue waiting_requests;
 
+    /* Start of the copy, zero for operations that do not copy data */
+    int64_t start_ns;
+
     QTAILQ_ENTRY(MirrorOp) next;
 };
 
@@ -160,6 +180,61 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/*
+ * Adapt the copy window to the target.  The average latency of the copy
+ * operations completed in each period is compared with the lowest one
+ * seen for the current chunk size.  As long as it does not grow while the
+ * window is full, the target keeps up: one more operation may be in
+ * flight, and once there are MAX_IN_FLIGHT, the chunk size doubles.  When
+ * the latency doubles, requests are queueing up in the target, which
+ * also slows down the guest: halve the number of operations in flight,
+ * and the chunk size once it is down to one operation.
+ */
+static void mirror_adapt(MirrorBlockJob *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t period = now - s->adapt_start_ns;
+    uint64_t latency;
+
+    if (period < BLOCK_JOB_SLICE_TIME || s->adapt_ops < MIRROR_ADAPT_MIN_OPS) {
+        return;
+    }
+
+    latency = s->adapt_latency_ns / s->adapt_ops;
+    s->latency_ns = latency;
+    s->bandwidth = muldiv64(s->adapt_bytes, NANOSECONDS_PER_SECOND, period);
+
+    if (!s->base_latency_ns || latency < s->base_latency_ns) {
+        s->base_latency_ns = latency;
+    }
+
+    if (latency > 2 * s->base_latency_ns) {
+        if (s->max_in_flight > 1) {
+            s->max_in_flight /= 2;
+        } else if (s->chunk_size > s->granularity) {
+            s->chunk_size = MAX(s->chunk_size / 2, s->granularity);
+            s->base_latency_ns = 0;
+        }
+    } else if (latency <= s->base_latency_ns + s->base_latency_ns / 4 &&
+               s->window_full) {
+        if (s->max_in_flight < MAX_IN_FLIGHT) {
+            s->max_in_flight++;
+        } else if (s->chunk_size < s->max_chunk_size) {
+            s->chunk_size = MIN(s->chunk_size * 2, s->max_chunk_size);
+            s->base_latency_ns = 0;
+        }
+    }
+
+    trace_mirror_adapt(s, latency, s->bandwidth, s->max_in_flight,
+                       s->chunk_size);
+
+    s->adapt_start_ns = now;
+    s->adapt_bytes = 0;
+    s->adapt_latency_ns = 0;
+    s->adapt_ops = 0;
+    s->window_full = false;
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -190,6 +265,13 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        if (op->start_ns) {
+            s->adapt_latency_ns +=
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns;
+            s->adapt_bytes += op->bytes;
+            s->adapt_ops++;
+            mirror_adapt(s);
+        }
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -364,6 +446,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     /* Copy the dirty cluster.  */
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
@@ -452,7 +535,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->chunk_size;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -549,8 +632,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
+            s->window_full = true;
             mirror_wait_for_free_in_flight_slot(s);
         }
 
@@ -920,6 +1004,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     mirror_free_init(s);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->adapt_start_ns = s->last_pause_ns;
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
         if (ret < 0 || job_is_cancelled(&s->common.job)) {
@@ -960,9 +1045,12 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
+                if (cnt != 0) {
+                    s->window_full = true;
+                }
                 mirror_wait_for_free_in_flight_slot(s);
                 continue;
             } else if (cnt != 0) {
@@ -1158,6 +1246,20 @@ static void mirror_drain(BlockJob *job)
     }
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_mirror = true;
+    info->mirror = g_new0(BlockJobInfoMirror, 1);
+    *info->mirror = (BlockJobInfoMirror) {
+        .chunk_size     = s->chunk_size,
+        .max_in_flight  = s->max_in_flight,
+        .latency_ns     = s->latency_ns,
+        .bandwidth      = s->bandwidth,
+    };
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1173,6 +1275,7 @@ static const BlockJobDriver mirror_job_driver = {
     },
     .drained_poll           = mirror_drained_poll,
     .drain                  = mirror_drain,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1190,6 +1293,7 @@ static const BlockJobDriver commit_active_job_driver = {
     },
     .drained_poll           = mirror_drained_poll,
     .drain                  = mirror_drain,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1629,6 +1733,14 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+
+    /*
+     * Start with the fixed window used before the job adapted it, and never
+     * let a single operation take more than a quarter of the buffer
+     */
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->chunk_size = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->max_chunk_size = MAX(s->buf_size / 4, s->chunk_size);
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -17,6 +17,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/cutils.h"
 #include "qemu/option.h"
@@ -30,6 +31,9 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_MAX_IO_QUEUES 64
+/* How often completions are checked for when I/O queues have no interrupts */
+#define NVME_POLL_TIMER_NS 100000
 
 typedef struct {
     int32_t  head, tail;
@@ -55,6 +59,7 @@ typedef struct {
     /* Fields protected by BQL */
     int         index;
     uint8_t     *prp_list_pages;
+    bool        polled; /* created without interrupts */
 
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
@@ -97,6 +102,7 @@ typedef struct {
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    int next_ioq; /* I/O queue for the next request */
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -107,6 +113,10 @@ typedef struct {
     uint64_t max_transfer;
     bool plugged;
 
+    /* Polled I/O completion queues, see nvme_io_queues_polled() */
+    bool poll_mode;
+    QEMUTimer *poll_timer;
+
     CoMutex dma_map_lock;
     CoQueue dma_flush_queue;
 
@@ -119,6 +129,8 @@ typedef struct {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
+#define NVME_BLOCK_OPT_POLL "poll"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -134,6 +146,17 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
+        {
+            .name = NVME_BLOCK_OPT_POLL,
+            .type = QEMU_OPT_BOOL,
+            .help = "Reap I/O completions by polling instead of interrupts "
+                    "(default: off)",
+        },
         { /* end of list */ }
     },
 };
@@ -390,6 +413,25 @@ static void nvme_submit_command(BDRVNVMeState *s, NVMeQueuePair *q,
     qemu_mutex_unlock(&q->lock);
 }
 
+/*
+ * Pick the I/O queue pair for a new request.  Requests are spread over the
+ * queues in turn so that the controller can work on all of them at once.
+ */
+static NVMeQueuePair *nvme_get_ioq(BDRVNVMeState *s)
+{
+    NVMeQueuePair *q;
+
+    if (s->nr_queues == 1) {
+        /* All I/O queues were lost in nvme_update_io_queues() */
+        return NULL;
+    }
+    if (s->next_ioq < 1 || s->next_ioq >= s->nr_queues) {
+        s->next_ioq = 1;
+    }
+    q = s->queues[s->next_ioq++];
+    return q;
+}
+
 static void nvme_cmd_sync_cb(void *opaque, int ret)
 {
     int *pret = opaque;
@@ -498,28 +540,98 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+/* Arm the poll timer if any I/O queue has requests in flight. */
+static void nvme_poll_timer_arm(BDRVNVMeState *s)
+{
+    bool busy = false;
+    int i;
+
+    if (!s->poll_timer || timer_pending(s->poll_timer)) {
+        return;
+    }
+    for (i = 1; i < s->nr_queues && !busy; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        if (!q->polled) {
+            continue;
+        }
+        qemu_mutex_lock(&q->lock);
+        busy = q->inflight || q->need_kick;
+        qemu_mutex_unlock(&q->lock);
+    }
+    if (busy) {
+        timer_mod(s->poll_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                                 NVME_POLL_TIMER_NS);
+    }
+}
+
+/*
+ * Polled I/O completion queues are created without interrupts, and
+ * completions are normally reaped by nvme_poll_cb() from the event loop's
+ * polling.  The event loop stops polling when the adaptive polling window
+ * runs out though, so as long as requests are in flight this timer keeps
+ * it from sleeping for longer than NVME_POLL_TIMER_NS.
+ */
+static void nvme_poll_timer_cb(void *opaque)
+{
+    BDRVNVMeState *s = opaque;
+
+    trace_nvme_poll_timer_cb(s);
+    nvme_poll_queues(s);
+    nvme_poll_timer_arm(s);
+}
+
+static void nvme_poll_timer_init(BDRVNVMeState *s, AioContext *ctx)
+{
+    if (s->poll_mode) {
+        s->poll_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                      nvme_poll_timer_cb, s);
+    }
+}
+
+static void nvme_poll_timer_cleanup(BDRVNVMeState *s)
+{
+    if (s->poll_timer) {
+        timer_del(s->poll_timer);
+        timer_free(s->poll_timer);
+        s->poll_timer = NULL;
+    }
+}
+
+/*
+ * Only the adaptive polling of an IOThread reaps polled completion queues
+ * promptly.  The main loop does not poll, so there every request would
+ * wait for the poll timer, and the queues use interrupts instead.
+ */
+static bool nvme_io_queues_polled(BDRVNVMeState *s)
+{
+    return s->poll_mode && s->aio_context != qemu_get_aio_context();
+}
+
+/* Create I/O queue pair @n on the controller */
+static NVMeQueuePair *nvme_create_io_queue(BlockDriverState *bs, int n,
+                                           Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
-    int n = s->nr_queues;
     NVMeQueuePair *q;
     NvmeCmd cmd;
     int queue_size = NVME_QUEUE_SIZE;
 
     q = nvme_create_queue_pair(bs, n, queue_size, errp);
     if (!q) {
-        return false;
+        return NULL;
     }
+    q->polled = nvme_io_queues_polled(s);
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
-        .cdw11 = cpu_to_le32(0x3),
+        /* Physically contiguous, interrupts enabled unless polling */
+        .cdw11 = cpu_to_le32(q->polled ? 0x1 : 0x3),
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
         nvme_free_queue_pair(bs, q);
-        return false;
+        return NULL;
     }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_SQ,
@@ -529,7 +641,32 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
+        /*
+         * Delete the CQ again, the controller must not post to it once the
+         * memory is freed.  If that fails too, leak the queue pair.
+         */
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_DELETE_CQ,
+            .cdw10 = cpu_to_le32(n & 0xFFFF),
+        };
+        if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+            trace_nvme_delete_cq_fail(s, n);
+            return NULL;
+        }
         nvme_free_queue_pair(bs, q);
+        return NULL;
+    }
+    return q;
+}
+
+static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int n = s->nr_queues;
+    NVMeQueuePair *q;
+
+    q = nvme_create_io_queue(bs, n, errp);
+    if (!q) {
         return false;
     }
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
@@ -538,6 +675,69 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     return true;
 }
 
+/* Delete I/O queue pair @n from the controller */
+static bool nvme_delete_io_queue(BlockDriverState *bs, int n)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_DELETE_SQ,
+        .cdw10 = cpu_to_le32(n & 0xFFFF),
+    };
+
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        return false;
+    }
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(n & 0xFFFF),
+    };
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        trace_nvme_delete_cq_fail(s, n);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Interrupts are enabled when a completion queue is created, so recreate
+ * the I/O queues that are polled when they should not be, or the other way
+ * round.  The node is drained, there are no requests in flight.
+ */
+static void nvme_update_io_queues(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    bool polled = nvme_io_queues_polled(s);
+    Error *local_err = NULL;
+    NVMeQueuePair *q;
+    int i;
+
+    for (i = 1; i < s->nr_queues; i++) {
+        int index = s->queues[i]->index;
+
+        if (s->queues[i]->polled == polled) {
+            continue;
+        }
+        if (!nvme_delete_io_queue(bs, index)) {
+            /* Keep using it, the poll timer still covers polled queues */
+            trace_nvme_delete_io_queue_fail(s, index);
+            continue;
+        }
+        q = nvme_create_io_queue(bs, index, &local_err);
+        if (!q) {
+            error_reportf_err(local_err, "Failed to recreate NVMe I/O queue: ");
+            local_err = NULL;
+            nvme_free_queue_pair(bs, s->queues[i]);
+            memmove(&s->queues[i], &s->queues[i + 1],
+                    (s->nr_queues - i - 1) * sizeof(s->queues[0]));
+            s->nr_queues--;
+            i--;
+            continue;
+        }
+        nvme_free_queue_pair(bs, s->queues[i]);
+        s->queues[i] = q;
+    }
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -549,11 +749,29 @@ static bool nvme_poll_cb(void *opaque)
     return progress;
 }
 
+/*
+ * Ask the controller for @n I/O queue pairs.  Controllers can allocate
+ * fewer than that, in which case creating the extra queues fails later.
+ */
+static void nvme_set_num_queues(BlockDriverState *bs, int n)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((n - 1) << 16) | (n - 1)),
+    };
+
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        trace_nvme_set_num_queues_fail(s, n);
+    }
+}
+
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
-    int ret;
+    int i, ret;
     uint64_t cap;
     uint64_t timeout_ms;
     uint64_t deadline, now;
@@ -648,6 +866,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
                            false, nvme_handle_event, nvme_poll_cb);
+    nvme_poll_timer_init(s, bdrv_get_aio_context(bs));
 
     nvme_identify(bs, namespace, &local_err);
     if (local_err) {
@@ -657,8 +876,19 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
+    if (num_queues > 1) {
+        nvme_set_num_queues(bs, num_queues);
+    }
     if (!nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
+        goto out;
+    }
+    for (i = 1; i < num_queues; i++) {
+        if (!nvme_add_io_queue(bs, NULL)) {
+            warn_report("NVMe controller only provided %d of %d I/O queues",
+                        i, num_queues);
+            break;
+        }
     }
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
@@ -729,6 +959,7 @@ static void nvme_close(BlockDriverState *bs)
         nvme_free_queue_pair(bs, s->queues[i]);
     }
     g_free(s->queues);
+    nvme_poll_timer_cleanup(s);
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
                            false, NULL, NULL);
     event_notifier_cleanup(&s->irq_notifier);
@@ -744,6 +975,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -757,7 +989,15 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->poll_mode = qemu_opt_get_bool(opts, NVME_BLOCK_OPT_POLL, false);
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -915,7 +1155,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     uint32_t cdw12 = (((bytes >> BDRV_SECTOR_BITS) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -932,7 +1172,10 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
+    ioq = nvme_get_ioq(s);
+    if (!ioq) {
+        return -EIO;
+    }
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -944,6 +1187,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         return r;
     }
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
+    nvme_poll_timer_arm(s);
 
     data.co = qemu_coroutine_self();
     while (data.ret == -EINPROGRESS) {
@@ -1029,7 +1273,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_ioq(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1040,10 +1284,13 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
         .ret = -EINPROGRESS,
     };
 
-    assert(s->nr_queues > 1);
+    if (!ioq) {
+        return -EIO;
+    }
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
+    nvme_poll_timer_arm(s);
 
     data.co = qemu_coroutine_self();
     if (data.ret == -EINPROGRESS) {
@@ -1083,6 +1330,7 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
 
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
                            false, NULL, NULL);
+    nvme_poll_timer_cleanup(s);
 }
 
 static void nvme_attach_aio_context(BlockDriverState *bs,
@@ -1093,6 +1341,8 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     s->aio_context = new_context;
     aio_set_event_notifier(new_context, &s->irq_notifier,
                            false, nvme_handle_event, nvme_poll_cb);
+    nvme_poll_timer_init(s, new_context);
+    nvme_update_io_queues(bs);
 }
 
 static void nvme_aio_plug(BlockDriverState *bs)
@@ -1115,6 +1365,7 @@ static void nvme_aio_unplug(BlockDriverState *bs)
         nvme_process_completion(s, q);
         qemu_mutex_unlock(&q->lock);
     }
+    nvme_poll_timer_arm(s);
 }
 
 static void nvme_register_buf(BlockDriverState *bs, void *host, size_t size)
@@ -1141,6 +1392,8 @@ static void nvme_unregister_buf(BlockDriverState *bs, void *host)
 static const char *const nvme_strong_runtime_opts[] = {
     NVME_BLOCK_OPT_DEVICE,
     NVME_BLOCK_OPT_NAMESPACE,
+    NVME_BLOCK_OPT_NUM_QUEUES,
+    NVME_BLOCK_OPT_POLL,
 
     NULL
 };
@@ -428,6 +428,71 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static void bdrv_latency_log_stats(BlockLatencyLog *log, bool *not_null,
+                                   BlockLatencyPercentiles **info)
+{
+    uint64_t count = stat64_get(&log->count);
+
+    *not_null = count > 0;
+    if (*not_null) {
+        *info = g_new0(BlockLatencyPercentiles, 1);
+
+        (*info)->operations = count;
+        (*info)->mean_ns = stat64_get(&log->total_ns) / count;
+        (*info)->p50_ns = block_latency_log_percentile(log, 500);
+        (*info)->p90_ns = block_latency_log_percentile(log, 900);
+        (*info)->p99_ns = block_latency_log_percentile(log, 990);
+        (*info)->p999_ns = block_latency_log_percentile(log, 999);
+        (*info)->max_ns = stat64_get(&log->max_ns);
+    }
+}
+
+/*
+ * Append the statistics for @stage to the list ending at @p_next, unless
+ * no request went through it.  @logs is indexed by BlockAcctType.
+ */
+static BlockLatencyStageStatsList **
+bdrv_latency_stage_stats(BlockLatencyStageStatsList **p_next,
+                         BlockLatencyStage stage, BlockLatencyLog *logs)
+{
+    BlockLatencyStageStats *info = g_new0(BlockLatencyStageStats, 1);
+    BlockLatencyStageStatsList *entry;
+
+    info->stage = stage;
+    bdrv_latency_log_stats(&logs[BLOCK_ACCT_READ], &info->has_rd, &info->rd);
+    bdrv_latency_log_stats(&logs[BLOCK_ACCT_WRITE], &info->has_wr, &info->wr);
+    bdrv_latency_log_stats(&logs[BLOCK_ACCT_FLUSH], &info->has_flush,
+                           &info->flush);
+
+    if (!info->has_rd && !info->has_wr && !info->has_flush) {
+        qapi_free_BlockLatencyStageStats(info);
+        return p_next;
+    }
+
+    entry = g_new0(BlockLatencyStageStatsList, 1);
+    entry->value = info;
+    *p_next = entry;
+    return &entry->next;
+}
+
+/* Prepend the BlockBackend level stages to the node level ones in @s */
+static void bdrv_query_blk_latency_stages(BlockStats *s, BlockBackend *blk)
+{
+    BlockAcctStats *stats = blk_get_stats(blk);
+    BlockLatencyStageStatsList *head = NULL, **p_next = &head;
+
+    p_next = bdrv_latency_stage_stats(p_next, BLOCK_LATENCY_STAGE_DEVICE,
+        stats->stage_latency[BLOCK_ACCT_STAGE_DEVICE]);
+    p_next = bdrv_latency_stage_stats(p_next, BLOCK_LATENCY_STAGE_QUEUE,
+        stats->stage_latency[BLOCK_ACCT_STAGE_QUEUE]);
+    p_next = bdrv_latency_stage_stats(p_next, BLOCK_LATENCY_STAGE_THROTTLE,
+        stats->stage_latency[BLOCK_ACCT_STAGE_THROTTLE]);
+
+    *p_next = s->latency_stages;
+    s->latency_stages = head;
+    s->has_latency_stages = head != NULL;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -509,6 +574,7 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
                                         bool blk_level)
 {
     BlockStats *s = NULL;
+    BlockLatencyStageStatsList **p_next;
 
     s = g_malloc0(sizeof(*s));
     s->stats = g_malloc0(sizeof(*s->stats));
@@ -532,6 +598,18 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    if (s->driver_specific) {
+        s->has_driver_specific = true;
+    }
+
+    p_next = bdrv_latency_stage_stats(&s->latency_stages,
+                                      BLOCK_LATENCY_STAGE_REQUEST,
+                                      bs->request_latency);
+    bdrv_latency_stage_stats(p_next, BLOCK_LATENCY_STAGE_DRIVER,
+                             bs->driver_latency);
+    s->has_latency_stages = s->latency_stages != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
@@ -620,6 +698,7 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
             }
 
             bdrv_query_blk_stats(s->stats, blk);
+            bdrv_query_blk_latency_stages(s, blk);
             aio_context_release(ctx);
 
             info = g_malloc0(sizeof(*info));
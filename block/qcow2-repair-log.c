@@ -0,0 +1,405 @@
+/*
+ * Repair log for qcow2 images with lazy refcounts
+ *
+ * With lazy refcounts, refcount updates for newly allocated data clusters
+ * may not have reached the disk when QEMU crashes.  Without further
+ * information, the only way to repair such an image is a full refcount
+ * rebuild, which has to walk every L2 table of the image.
+ *
+ * The repair log records which L2 tables have been modified since the image
+ * was last marked clean.  It is a bitmap with one bit per L1 table entry;
+ * the bit for an L1 entry is written to disk before the first update of the
+ * corresponding L2 table reaches the disk.  Repairing a dirty image then
+ * only needs to look at the L2 tables recorded in the log.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+
+#include "qcow2.h"
+
+static inline bool repair_log_test(BDRVQcow2State *s, uint64_t l1_index)
+{
+    return s->repair_log[l1_index / 8] & (1 << (l1_index % 8));
+}
+
+/*
+ * Reads the on-disk log into memory.  If the log is not valid (e.g. because
+ * a program without repair log support has modified the image, which cleared
+ * the autoclear bit) it is left unloaded, and a dirty image has to be
+ * repaired with a full refcount check.
+ */
+int qcow2_repair_log_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->repair_log_offset ||
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_REPAIR_LOG)) {
+        return 0;
+    }
+
+    if (s->repair_log_size * 8 < s->l1_size) {
+        /* The L1 table has grown beyond what the log can describe */
+        return 0;
+    }
+
+    s->repair_log = g_try_malloc(s->repair_log_size);
+    if (s->repair_log == NULL) {
+        error_setg(errp, "Could not allocate memory for the repair log");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->repair_log_offset, s->repair_log,
+                     s->repair_log_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the repair log");
+        g_free(s->repair_log);
+        s->repair_log = NULL;
+        return ret;
+    }
+
+    s->repair_log_dirty = !buffer_is_zero(s->repair_log, s->repair_log_size);
+    return 0;
+}
+
+/*
+ * Allocates a new, empty log that is large enough for the current L1 table
+ * and makes the image header point to it.  An existing log is freed.
+ */
+int qcow2_repair_log_create(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->repair_log_offset;
+    uint64_t old_size = s->repair_log_size;
+    uint64_t old_autocl = s->autoclear_features;
+    uint64_t size;
+    int64_t offset;
+    uint8_t *log;
+    int ret;
+
+    assert(s->qcow_version >= 3);
+
+    size = ROUND_UP(MAX(DIV_ROUND_UP(s->l1_size, 8), 1), s->cluster_size);
+    log = g_try_malloc0(size);
+    if (log == NULL) {
+        error_setg(errp, "Could not allocate memory for the repair log");
+        return -ENOMEM;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Could not allocate the repair log");
+        g_free(log);
+        return offset;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the repair log");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, log, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the repair log");
+        goto fail;
+    }
+
+    /*
+     * The log clusters must be accounted for before the header refers to
+     * them, even with lazy refcounts
+     */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the repair log");
+        goto fail;
+    }
+
+    s->repair_log_offset = offset;
+    s->repair_log_size = size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_REPAIR_LOG;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        s->repair_log_offset = old_offset;
+        s->repair_log_size = old_size;
+        s->autoclear_features = old_autocl;
+        goto fail;
+    }
+
+    g_free(s->repair_log);
+    s->repair_log = log;
+    s->repair_log_dirty = false;
+
+    if (old_offset) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    g_free(log);
+    return ret;
+}
+
+/*
+ * Makes the log of an image that has been opened read-write valid and empty.
+ * The image must not be dirty.
+ */
+int qcow2_repair_log_reset(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->repair_log_offset) {
+        return 0;
+    }
+
+    assert(!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY));
+
+    if (s->repair_log_size * 8 < s->l1_size) {
+        return qcow2_repair_log_create(bs, errp);
+    }
+
+    if (s->repair_log == NULL) {
+        s->repair_log = g_try_malloc(s->repair_log_size);
+        if (s->repair_log == NULL) {
+            error_setg(errp, "Could not allocate memory for the repair log");
+            return -ENOMEM;
+        }
+        s->repair_log_dirty = true;
+    }
+
+    if (s->repair_log_dirty) {
+        memset(s->repair_log, 0, s->repair_log_size);
+        ret = bdrv_pwrite(bs->file, s->repair_log_offset, s->repair_log,
+                          s->repair_log_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not clear the repair log");
+            goto fail;
+        }
+        s->repair_log_dirty = false;
+    }
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_REPAIR_LOG)) {
+        /* The cleared log must be on disk before it is declared valid */
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not clear the repair log");
+            goto fail;
+        }
+
+        s->autoclear_features |= QCOW2_AUTOCLEAR_REPAIR_LOG;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update qcow2 header");
+            s->autoclear_features &= ~QCOW2_AUTOCLEAR_REPAIR_LOG;
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    g_free(s->repair_log);
+    s->repair_log = NULL;
+    return ret;
+}
+
+void qcow2_repair_log_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    g_free(s->repair_log);
+    s->repair_log = NULL;
+}
+
+/*
+ * Stops using the log because it cannot describe the image any more.  The
+ * next read-write open allocates a new one.
+ */
+static int repair_log_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_REPAIR_LOG;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_REPAIR_LOG;
+        return ret;
+    }
+
+    qcow2_repair_log_close(bs);
+    qcow2_cache_depends_on_flush(s->l2_table_cache);
+    return 0;
+}
+
+/*
+ * Records that the L2 table referenced by the given L1 entry is about to be
+ * modified.  Must be called before the L2 table is marked dirty in the cache.
+ */
+int qcow2_repair_log_mark(BlockDriverState *bs, uint64_t l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t byte, sector;
+    int ret;
+
+    /* Without lazy refcounts, L2 updates never get ahead of refcounts */
+    if (s->repair_log == NULL || !s->use_lazy_refcounts) {
+        return 0;
+    }
+
+    byte = l1_index / 8;
+    if (byte >= s->repair_log_size) {
+        return repair_log_invalidate(bs);
+    }
+    if (repair_log_test(s, l1_index)) {
+        return 0;
+    }
+
+    s->repair_log[byte] |= 1 << (l1_index % 8);
+    sector = QEMU_ALIGN_DOWN(byte, BDRV_SECTOR_SIZE);
+    ret = bdrv_pwrite(bs->file, s->repair_log_offset + sector,
+                      s->repair_log + sector, BDRV_SECTOR_SIZE);
+    if (ret < 0) {
+        s->repair_log[byte] &= ~(1 << (l1_index % 8));
+        return ret;
+    }
+
+    s->repair_log_dirty = true;
+    qcow2_cache_depends_on_flush(s->l2_table_cache);
+    return 0;
+}
+
+/*
+ * Empties the log.  Must only be called after the dirty bit has been cleared,
+ * because at that point all refcounts are on disk.
+ */
+int qcow2_repair_log_clear(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (s->repair_log == NULL || !s->repair_log_dirty) {
+        return 0;
+    }
+
+    memset(s->repair_log, 0, s->repair_log_size);
+    ret = bdrv_pwrite(bs->file, s->repair_log_offset, s->repair_log,
+                      s->repair_log_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->repair_log_dirty = false;
+    return 0;
+}
+
+/*
+ * Restores the refcounts of all data clusters referenced by the L2 tables
+ * recorded in the log.  With lazy refcounts, the only refcount updates that
+ * can be lost are increments from 0 to 1 for newly allocated clusters (and
+ * decrements, which only leak clusters); metadata allocations are always
+ * flushed before they are referenced.
+ *
+ * Returns -EINVAL if the L2 tables look broken, in which case the caller
+ * should fall back to a full refcount check.
+ */
+int coroutine_fn qcow2_repair_log_replay(BlockDriverState *bs,
+                                         BdrvCheckResult *res)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t i;
+    int j, ret = 0;
+
+    assert(s->repair_log);
+
+    if (has_data_file(bs)) {
+        /* Guest data clusters are not refcounted */
+        return 0;
+    }
+
+    l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (l2_table == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < s->l1_size; i++) {
+        uint64_t l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+
+        if (!l2_offset || !repair_log_test(s, i)) {
+            continue;
+        }
+
+        if (offset_into_cluster(s, l2_offset)) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+
+        for (j = 0; j < s->l2_size; j++) {
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
+            uint64_t host_offset = l2_entry & L2E_OFFSET_MASK;
+            QCow2ClusterType type = qcow2_get_cluster_type(bs, l2_entry);
+            uint64_t refcount;
+
+            if (type != QCOW2_CLUSTER_NORMAL &&
+                type != QCOW2_CLUSTER_ZERO_ALLOC) {
+                continue;
+            }
+
+            if (offset_into_cluster(s, host_offset)) {
+                ret = -EINVAL;
+                goto out;
+            }
+
+            ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits,
+                                     &refcount);
+            if (ret < 0) {
+                goto out;
+            }
+            if (refcount > 0) {
+                continue;
+            }
+
+            ret = qcow2_update_cluster_refcount(bs,
+                                                host_offset >> s->cluster_bits,
+                                                1, false, QCOW2_DISCARD_NEVER);
+            if (ret < 0) {
+                goto out;
+            }
+            res->corruptions_fixed++;
+        }
+    }
+
+    ret = 0;
+out:
+    qemu_vfree(l2_table);
+    return ret;
+}
@@ -0,0 +1,686 @@
+/*
+ * Read-ahead filter block driver
+ *
+ * Copyright (c) 2019 The QEMU Project Developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The filter recognizes sequential read streams and reads ahead of them
+ * into a pool of buffers that it owns.  This gives sequential guest reads
+ * good throughput with cache.direct=on on high latency storage, without
+ * going through the host page cache.
+ *
+ * The pool is divided into buffers of readahead-size bytes, each caching
+ * one aligned chunk of the image.  A read is served from the pool only if
+ * all of it is cached; reads that find a chunk still being loaded wait for
+ * it.  Writes drop the chunks they overlap, and no chunk is loaded while a
+ * write to it is in flight, so the pool never returns stale data.  Writes
+ * that bypass the filter would not drop anything, so the child is not
+ * shared with other writers.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define READAHEAD_OPT_SIZE      "readahead-size"
+#define READAHEAD_OPT_POOL_SIZE "pool-size"
+#define READAHEAD_OPT_STREAMS   "streams"
+
+#define READAHEAD_DEFAULT_SIZE      (1 * MiB)
+#define READAHEAD_DEFAULT_POOL_SIZE (32 * MiB)
+#define READAHEAD_DEFAULT_STREAMS   8
+
+#define READAHEAD_MIN_SIZE      (4 * KiB)
+#define READAHEAD_MAX_SIZE      (64 * MiB)
+#define READAHEAD_MAX_POOL_SIZE (1 * GiB)
+#define READAHEAD_MAX_STREAMS   64
+
+/* Number of reads that make a stream sequential */
+#define READAHEAD_SEQUENTIAL_READS 2
+
+typedef enum ReadaheadBufferState {
+    READAHEAD_BUFFER_EMPTY,
+    READAHEAD_BUFFER_LOADING,
+    READAHEAD_BUFFER_VALID,
+} ReadaheadBufferState;
+
+typedef struct ReadaheadBuffer {
+    BlockDriverState *bs;
+    ReadaheadBufferState state;
+    int64_t offset;             /* multiple of readahead-size */
+    int64_t bytes;              /* less than readahead-size at the end */
+    bool stale;                 /* overlapped by a write while loading */
+    bool used;                  /* at least one read was served from it */
+    uint64_t lru_ticket;
+    CoQueue waiters;            /* reads waiting for the load to finish */
+    uint8_t *data;
+} ReadaheadBuffer;
+
+typedef struct ReadaheadStream {
+    int64_t next_offset;        /* end of the last read of the stream */
+    unsigned int reads;         /* 0 if the slot is unused */
+    uint64_t lru_ticket;
+} ReadaheadStream;
+
+typedef struct ReadaheadWrite {
+    int64_t offset;
+    int64_t bytes;
+    QLIST_ENTRY(ReadaheadWrite) next;
+} ReadaheadWrite;
+
+typedef struct ReadaheadPool {
+    int64_t readahead_size;
+    int num_buffers;
+    ReadaheadBuffer *buffers;
+    uint8_t *data;
+    int num_streams;
+    ReadaheadStream *streams;
+} ReadaheadPool;
+
+typedef struct BDRVReadaheadState {
+    ReadaheadPool pool;
+    uint64_t lru_ticket;
+    QLIST_HEAD(, ReadaheadWrite) writes;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetch_bytes;
+    uint64_t unused_bytes;
+} BDRVReadaheadState;
+
+static QemuOptsList readahead_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(readahead_opts.head),
+    .desc = {
+        {
+            .name = READAHEAD_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Bytes to read ahead of a sequential stream "
+                    "(default: 1M)",
+        },
+        {
+            .name = READAHEAD_OPT_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Memory for read-ahead data (default: 32M)",
+        },
+        {
+            .name = READAHEAD_OPT_STREAMS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sequential streams to track (default: 8)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void readahead_pool_free(ReadaheadPool *pool)
+{
+    qemu_vfree(pool->data);
+    g_free(pool->buffers);
+    g_free(pool->streams);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/* Parse the options in @options and allocate a pool according to them */
+static int readahead_pool_new(BlockDriverState *bs, QDict *options,
+                              ReadaheadPool *pool, Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&readahead_opts, NULL, 0,
+                                      &error_abort);
+    Error *local_err = NULL;
+    uint64_t size, pool_size, streams;
+    int i, ret;
+
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fin;
+    }
+
+    size = qemu_opt_get_size(opts, READAHEAD_OPT_SIZE,
+                             READAHEAD_DEFAULT_SIZE);
+    pool_size = qemu_opt_get_size(opts, READAHEAD_OPT_POOL_SIZE,
+                                  READAHEAD_DEFAULT_POOL_SIZE);
+    streams = qemu_opt_get_number(opts, READAHEAD_OPT_STREAMS,
+                                  READAHEAD_DEFAULT_STREAMS);
+
+    if (size < READAHEAD_MIN_SIZE || size > READAHEAD_MAX_SIZE ||
+        !is_power_of_2(size)) {
+        error_setg(errp, "'" READAHEAD_OPT_SIZE "' must be a power of two "
+                   "between %d and %d", (int)READAHEAD_MIN_SIZE,
+                   (int)READAHEAD_MAX_SIZE);
+        ret = -EINVAL;
+        goto fin;
+    }
+    if (pool_size < 2 * size || pool_size > READAHEAD_MAX_POOL_SIZE) {
+        error_setg(errp, "'" READAHEAD_OPT_POOL_SIZE "' must be at least "
+                   "twice '" READAHEAD_OPT_SIZE "' and at most %" PRIu64,
+                   (uint64_t)READAHEAD_MAX_POOL_SIZE);
+        ret = -EINVAL;
+        goto fin;
+    }
+    if (streams < 1 || streams > READAHEAD_MAX_STREAMS) {
+        error_setg(errp, "'" READAHEAD_OPT_STREAMS "' must be between 1 "
+                   "and %d", READAHEAD_MAX_STREAMS);
+        ret = -EINVAL;
+        goto fin;
+    }
+
+    pool->readahead_size = size;
+    pool->num_buffers = pool_size / size;
+    pool->data = qemu_try_blockalign(bs->file->bs,
+                                     pool->num_buffers * size);
+    if (!pool->data) {
+        error_setg(errp, "Could not allocate the read-ahead pool");
+        ret = -ENOMEM;
+        goto fin;
+    }
+
+    pool->buffers = g_new0(ReadaheadBuffer, pool->num_buffers);
+    for (i = 0; i < pool->num_buffers; i++) {
+        pool->buffers[i].bs = bs;
+        pool->buffers[i].data = pool->data + i * size;
+        qemu_co_queue_init(&pool->buffers[i].waiters);
+    }
+    pool->num_streams = streams;
+    pool->streams = g_new0(ReadaheadStream, streams);
+    ret = 0;
+
+fin:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int readahead_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    ret = readahead_pool_new(bs, options, &s->pool, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QLIST_INIT(&s->writes);
+    return 0;
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->pool.num_buffers; i++) {
+        assert(s->pool.buffers[i].state != READAHEAD_BUFFER_LOADING);
+    }
+    readahead_pool_free(&s->pool);
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static ReadaheadBuffer *readahead_find_buffer(BDRVReadaheadState *s,
+                                              int64_t offset)
+{
+    int i;
+
+    for (i = 0; i < s->pool.num_buffers; i++) {
+        ReadaheadBuffer *buf = &s->pool.buffers[i];
+
+        if (buf->state != READAHEAD_BUFFER_EMPTY && buf->offset == offset) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void readahead_drop_buffer(BDRVReadaheadState *s, ReadaheadBuffer *buf)
+{
+    if (!buf->used) {
+        s->unused_bytes += buf->bytes;
+    }
+    buf->state = READAHEAD_BUFFER_EMPTY;
+}
+
+/*
+ * Record a read in the stream that it continues, or start a new stream in
+ * place of the least recently used one.  Reads that a guest has in flight
+ * at the same time may arrive out of order, so a read that starts close to
+ * the end of a stream continues it.
+ *
+ * Returns whether the stream is sequential.
+ */
+static bool readahead_track_stream(BDRVReadaheadState *s, int64_t offset,
+                                   int64_t bytes)
+{
+    ReadaheadStream *stream = NULL, *victim = &s->pool.streams[0];
+    int64_t window = s->pool.readahead_size;
+    int i;
+
+    for (i = 0; i < s->pool.num_streams; i++) {
+        ReadaheadStream *st = &s->pool.streams[i];
+
+        if (st->reads && offset < st->next_offset + window &&
+            offset + bytes > st->next_offset - window) {
+            stream = st;
+            break;
+        }
+        if (st->lru_ticket < victim->lru_ticket) {
+            victim = st;
+        }
+    }
+
+    if (!stream) {
+        stream = victim;
+        stream->reads = 0;
+        stream->next_offset = 0;
+    }
+
+    stream->next_offset = MAX(stream->next_offset, offset + bytes);
+    stream->reads++;
+    stream->lru_ticket = ++s->lru_ticket;
+
+    return stream->reads >= READAHEAD_SEQUENTIAL_READS;
+}
+
+static bool readahead_write_in_flight(BDRVReadaheadState *s, int64_t offset,
+                                      int64_t bytes)
+{
+    ReadaheadWrite *w;
+
+    QLIST_FOREACH(w, &s->writes, next) {
+        if (offset < w->offset + w->bytes && w->offset < offset + bytes) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Find a buffer to load a new chunk into, evicting the least recently used */
+static ReadaheadBuffer *readahead_get_free_buffer(BDRVReadaheadState *s)
+{
+    ReadaheadBuffer *victim = NULL;
+    int i;
+
+    for (i = 0; i < s->pool.num_buffers; i++) {
+        ReadaheadBuffer *buf = &s->pool.buffers[i];
+
+        if (buf->state == READAHEAD_BUFFER_EMPTY) {
+            return buf;
+        }
+        if (buf->state == READAHEAD_BUFFER_VALID &&
+            (!victim || buf->lru_ticket < victim->lru_ticket)) {
+            victim = buf;
+        }
+    }
+
+    if (victim) {
+        trace_readahead_evict(victim->bs, victim->offset, victim->used);
+        readahead_drop_buffer(victim->bs->opaque, victim);
+    }
+    return victim;
+}
+
+static void coroutine_fn readahead_load_entry(void *opaque)
+{
+    ReadaheadBuffer *buf = opaque;
+    BlockDriverState *bs = buf->bs;
+    BDRVReadaheadState *s = bs->opaque;
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_buf(&qiov, buf->data, buf->bytes);
+    ret = bdrv_co_preadv(bs->file, buf->offset, buf->bytes, &qiov, 0);
+    trace_readahead_load_done(bs, buf->offset, buf->bytes, buf->stale, ret);
+
+    if (ret < 0 || buf->stale) {
+        buf->state = READAHEAD_BUFFER_EMPTY;
+    } else {
+        buf->state = READAHEAD_BUFFER_VALID;
+        s->prefetch_bytes += buf->bytes;
+    }
+    qemu_co_queue_restart_all(&buf->waiters);
+    bdrv_dec_in_flight(bs);
+}
+
+/* Start loading the chunks of the pool's window behind @offset */
+static void coroutine_fn readahead_prefetch(BlockDriverState *bs,
+                                            int64_t offset)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int64_t size = s->pool.readahead_size;
+    int64_t length = bdrv_getlength(bs);
+    int64_t chunk;
+
+    if (length < 0) {
+        return;
+    }
+
+    for (chunk = QEMU_ALIGN_DOWN(offset, size);
+         chunk < MIN(offset + size, length);
+         chunk += size)
+    {
+        int64_t bytes = MIN(size, length - chunk);
+        ReadaheadBuffer *buf;
+        Coroutine *co;
+
+        if (readahead_find_buffer(s, chunk) ||
+            readahead_write_in_flight(s, chunk, bytes)) {
+            continue;
+        }
+        buf = readahead_get_free_buffer(s);
+        if (!buf) {
+            return;
+        }
+
+        buf->state = READAHEAD_BUFFER_LOADING;
+        buf->offset = chunk;
+        buf->bytes = bytes;
+        buf->stale = false;
+        buf->used = false;
+        buf->lru_ticket = ++s->lru_ticket;
+
+        trace_readahead_load(bs, chunk, bytes);
+        bdrv_inc_in_flight(bs);
+        co = qemu_coroutine_create(readahead_load_entry, buf);
+        qemu_coroutine_enter(co);
+    }
+}
+
+/*
+ * Serve the read from the pool if all of it is cached, waiting for chunks
+ * that are being loaded.  Returns whether the read was served.
+ */
+static bool coroutine_fn readahead_read_pool(BDRVReadaheadState *s,
+                                             int64_t offset, int64_t bytes,
+                                             QEMUIOVector *qiov)
+{
+    int64_t size = s->pool.readahead_size;
+    int64_t end = offset + bytes;
+    int64_t pos, n;
+    ReadaheadBuffer *buf;
+
+retry:
+    for (pos = offset; pos < end; pos = buf->offset + size) {
+        buf = readahead_find_buffer(s, QEMU_ALIGN_DOWN(pos, size));
+        if (!buf) {
+            return false;
+        }
+        if (buf->state == READAHEAD_BUFFER_LOADING) {
+            /* The pool may change while we wait, look at it again */
+            qemu_co_queue_wait(&buf->waiters, NULL);
+            goto retry;
+        }
+        if (buf->offset + buf->bytes < MIN(end, buf->offset + size)) {
+            return false;
+        }
+    }
+
+    for (pos = offset; pos < end; pos += n) {
+        buf = readahead_find_buffer(s, QEMU_ALIGN_DOWN(pos, size));
+        n = MIN(end, buf->offset + buf->bytes) - pos;
+        qemu_iovec_from_buf(qiov, pos - offset, buf->data + pos - buf->offset,
+                            n);
+        buf->used = true;
+        buf->lru_ticket = ++s->lru_ticket;
+    }
+    return true;
+}
+
+static int coroutine_fn readahead_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+
+    if (readahead_track_stream(s, offset, bytes)) {
+        readahead_prefetch(bs, offset + bytes);
+    }
+
+    if (!flags && readahead_read_pool(s, offset, bytes, qiov)) {
+        s->hits++;
+        return 0;
+    }
+
+    s->misses++;
+    return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+}
+
+/*
+ * Drop the chunks that the write overlaps, and keep chunks from being
+ * loaded while it is in flight.
+ */
+static void readahead_write_begin(BDRVReadaheadState *s, ReadaheadWrite *w,
+                                  int64_t offset, int64_t bytes)
+{
+    int64_t size = s->pool.readahead_size;
+    int i;
+
+    for (i = 0; i < s->pool.num_buffers; i++) {
+        ReadaheadBuffer *buf = &s->pool.buffers[i];
+
+        if (buf->state == READAHEAD_BUFFER_EMPTY ||
+            buf->offset >= offset + bytes || buf->offset + size <= offset) {
+            continue;
+        }
+        if (buf->state == READAHEAD_BUFFER_LOADING) {
+            buf->stale = true;
+        } else {
+            readahead_drop_buffer(s, buf);
+        }
+    }
+
+    w->offset = offset;
+    w->bytes = bytes;
+    QLIST_INSERT_HEAD(&s->writes, w, next);
+}
+
+static void readahead_write_end(ReadaheadWrite *w)
+{
+    QLIST_REMOVE(w, next);
+}
+
+static int coroutine_fn readahead_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadWrite w;
+    int ret;
+
+    readahead_write_begin(s, &w, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    readahead_write_end(&w);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadWrite w;
+    int ret;
+
+    readahead_write_begin(s, &w, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    readahead_write_end(&w);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadWrite w;
+    int ret;
+
+    readahead_write_begin(s, &w, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    readahead_write_end(&w);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_truncate(BlockDriverState *bs,
+                                              int64_t offset,
+                                              PreallocMode prealloc,
+                                              Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadWrite w;
+    int ret;
+
+    readahead_write_begin(s, &w, 0, INT64_MAX);
+    ret = bdrv_co_truncate(bs->file, offset, prealloc, errp);
+    readahead_write_end(&w);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int readahead_reopen_prepare(BDRVReopenState *reopen_state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    ReadaheadPool *pool = g_new0(ReadaheadPool, 1);
+    int ret;
+
+    ret = readahead_pool_new(reopen_state->bs, reopen_state->options, pool,
+                             errp);
+    if (ret < 0) {
+        g_free(pool);
+        return ret;
+    }
+
+    reopen_state->opaque = pool;
+    return 0;
+}
+
+/* The node is drained, so no chunk is being loaded */
+static void readahead_reopen_commit(BDRVReopenState *reopen_state)
+{
+    BDRVReadaheadState *s = reopen_state->bs->opaque;
+    ReadaheadPool *pool = reopen_state->opaque;
+
+    readahead_pool_free(&s->pool);
+    s->pool = *pool;
+    g_free(pool);
+    reopen_state->opaque = NULL;
+}
+
+static void readahead_reopen_abort(BDRVReopenState *reopen_state)
+{
+    ReadaheadPool *pool = reopen_state->opaque;
+
+    readahead_pool_free(pool);
+    g_free(pool);
+    reopen_state->opaque = NULL;
+}
+
+static BlockStatsSpecific *readahead_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+    BlockStatsSpecificReadahead *ra_stats = &stats->u.readahead;
+
+    stats->driver = BLOCKDEV_DRIVER_READAHEAD;
+    ra_stats->pool_size = s->pool.num_buffers * s->pool.readahead_size;
+    ra_stats->hits = s->hits;
+    ra_stats->misses = s->misses;
+    ra_stats->prefetch_bytes = s->prefetch_bytes;
+    ra_stats->unused_bytes = s->unused_bytes;
+
+    return stats;
+}
+
+static void readahead_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                 const BdrvChildRole *role,
+                                 BlockReopenQueue *ro_q,
+                                 uint64_t perm, uint64_t shared,
+                                 uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_filter_default_perms(bs, c, role, ro_q, perm, shared, nperm, nshared);
+
+    /* The pool would go stale if other users wrote to or resized the child */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static bool readahead_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                  BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_readahead = {
+    .format_name                        = "readahead",
+    .instance_size                      = sizeof(BDRVReadaheadState),
+
+    .bdrv_open                          = readahead_open,
+    .bdrv_close                         = readahead_close,
+    .bdrv_child_perm                    = readahead_child_perm,
+
+    .bdrv_reopen_prepare                = readahead_reopen_prepare,
+    .bdrv_reopen_commit                 = readahead_reopen_commit,
+    .bdrv_reopen_abort                  = readahead_reopen_abort,
+
+    .bdrv_getlength                     = readahead_getlength,
+    .bdrv_co_truncate                   = readahead_co_truncate,
+
+    .bdrv_co_preadv                     = readahead_co_preadv,
+    .bdrv_co_pwritev                    = readahead_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = readahead_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = readahead_co_pdiscard,
+    .bdrv_co_flush                      = readahead_co_flush,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+    .bdrv_get_specific_stats            = readahead_get_specific_stats,
+
+    .bdrv_recurse_is_first_non_filter   = readahead_recurse_is_first_non_filter,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead);
+}
+
+block_init(bdrv_readahead_init);
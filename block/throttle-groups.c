@@ -69,12 +69,14 @@ typedef struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
     QEMUClockType clock_type;
+    /* virtual time of the last request that was allowed to run */
+    uint64_t vtime[2];
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
@@ -205,8 +207,11 @@ static inline bool tgm_has_pending_reqs(ThrottleGroupMember *tgm,
     return tgm->pending_reqs[is_write];
 }
 
-/* Return the next ThrottleGroupMember in the round-robin sequence with pending
- * I/O requests.
+/*
+ * Return the ThrottleGroupMember with pending I/O requests that has the
+ * lowest virtual time, i.e. the one that got the least service relative to
+ * its weight. Members are visited in round-robin order starting after the
+ * current token, so members with the same virtual time take turns.
  *
  * This assumes that tg->lock is held.
  *
@@ -220,7 +225,7 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
 {
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
-    ThrottleGroupMember *token, *start;
+    ThrottleGroupMember *token, *start, *best = NULL;
 
     /* If this member has its I/O limits disabled then it means that
      * it's being drained. Skip the round-robin search and return tgm
@@ -233,19 +238,20 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
 
     start = token = tg->tokens[is_write];
 
-    /* get next bs round in round robin style */
-    token = throttle_group_next_tgm(token);
-    while (token != start && !tgm_has_pending_reqs(token, is_write)) {
+    do {
         token = throttle_group_next_tgm(token);
-    }
+        if (tgm_has_pending_reqs(token, is_write) &&
+            (!best || token->vtime[is_write] < best->vtime[is_write])) {
+            best = token;
+        }
+    } while (token != start);
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current tgm because chances are
-     * the current tgm got the current request queued.
+    /*
+     * If no IO are queued for scheduling on any member then decide the
+     * token is the current tgm because chances are the current tgm got
+     * the current request queued.
      */
-    if (token == start && !tgm_has_pending_reqs(token, is_write)) {
-        token = tgm;
-    }
+    token = best ? best : tgm;
 
     /* Either we return the original TGM, or one with pending requests */
     assert(token == tgm || tgm_has_pending_reqs(token, is_write));
@@ -334,11 +340,9 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current tgm */
-        if (qemu_in_coroutine() &&
-            throttle_group_co_restart_queue(tgm, is_write)) {
-            token = tgm;
-        } else {
+        /* Restart the current tgm directly if it is the one to go next */
+        if (token != tgm || !qemu_in_coroutine() ||
+            !throttle_group_co_restart_queue(tgm, is_write)) {
             ThrottleTimers *tt = &token->throttle_timers;
             int64_t now = qemu_clock_get_ns(tg->clock_type);
             timer_mod(tt->timers[is_write], now);
@@ -348,9 +352,38 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
     }
 }
 
+/*
+ * Charge an I/O request to a ThrottleGroupMember by advancing its virtual
+ * time. The cost is scaled by the inverse of the member's weight, so with
+ * all members busy each one gets a share of the group's limits that is
+ * proportional to its weight. Members that are idle are not charged, and
+ * the capacity they leave unused goes to the others.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember whose request is about to run
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_charge(ThrottleGroupMember *tgm,
+                                  unsigned int bytes, bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    uint64_t *vtime = &tgm->vtime[is_write];
+
+    /*
+     * A member that has been idle doesn't get to spend the share that it
+     * left unused: it restarts from the current virtual time.
+     */
+    *vtime = MAX(*vtime, tg->vtime[is_write]);
+    tg->vtime[is_write] = *vtime;
+    *vtime += (uint64_t) MAX(bytes, 1) * THROTTLE_GROUP_WEIGHT_DEFAULT /
+              tgm->weight;
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
- * if necessary, and schedule the next request using a round robin
- * algorithm.
+ * if necessary, and schedule the next request using a weighted fair
+ * queueing algorithm.
  *
  * @tgm:       the current ThrottleGroupMember
  * @bytes:     the number of bytes for this I/O
@@ -383,6 +416,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
+    throttle_group_charge(tgm, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -543,6 +577,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
 
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
+    tgm->weight = THROTTLE_GROUP_WEIGHT_DEFAULT;
     atomic_set(&tgm->restart_pending, 0);
 
     qemu_mutex_lock(&tg->lock);
@@ -551,6 +586,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
         if (!tg->tokens[i]) {
             tg->tokens[i] = tgm;
         }
+        tgm->vtime[i] = tg->vtime[i];
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
@@ -568,6 +604,24 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     qemu_mutex_unlock(&tg->lock);
 }
 
+/*
+ * Set the weight of a ThrottleGroupMember, i.e. its share of the group's
+ * I/O limits relative to the other members that have requests pending.
+ *
+ * @tgm:     a ThrottleGroupMember that is a member of a group
+ * @weight:  the new weight, between 1 and THROTTLE_GROUP_WEIGHT_MAX
+ */
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned int weight)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_WEIGHT_MAX);
+
+    qemu_mutex_lock(&tg->lock);
+    tgm->weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* Unregister a ThrottleGroupMember from its group, removing it from the list,
  * destroying the timers and setting the throttle_state pointer to NULL.
  *
@@ -33,19 +33,31 @@ static QemuOptsList throttle_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Name of the throttle group",
         },
+        {
+            .name = QEMU_OPT_THROTTLE_WEIGHT,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Share of the group's I/O limits (default: 100)",
+        },
         { /* end of list */ }
     },
 };
 
+typedef struct ThrottleReopenState {
+    char *group;
+    unsigned int weight;
+} ThrottleReopenState;
+
 /*
  * If this function succeeds then the throttle group name is stored in
- * @group and must be freed by the caller.
- * If there's an error then @group remains unmodified.
+ * @group and must be freed by the caller, and the weight in @weight.
+ * If there's an error then @group and @weight remain unmodified.
  */
-static int throttle_parse_options(QDict *options, char **group, Error **errp)
+static int throttle_parse_options(QDict *options, char **group,
+                                  unsigned int *weight, Error **errp)
 {
     int ret;
     const char *group_name;
+    uint64_t group_weight;
     Error *local_err = NULL;
     QemuOpts *opts = qemu_opts_create(&throttle_opts, NULL, 0, &error_abort);
 
@@ -67,7 +79,17 @@ static int throttle_parse_options(QDict *options, char **group, Error **errp)
         goto fin;
     }
 
+    group_weight = qemu_opt_get_number(opts, QEMU_OPT_THROTTLE_WEIGHT,
+                                       THROTTLE_GROUP_WEIGHT_DEFAULT);
+    if (group_weight < 1 || group_weight > THROTTLE_GROUP_WEIGHT_MAX) {
+        error_setg(errp, "'" QEMU_OPT_THROTTLE_WEIGHT "' must be between 1 "
+                   "and %d", THROTTLE_GROUP_WEIGHT_MAX);
+        ret = -EINVAL;
+        goto fin;
+    }
+
     *group = g_strdup(group_name);
+    *weight = group_weight;
     ret = 0;
 fin:
     qemu_opts_del(opts);
@@ -79,6 +101,7 @@ static int throttle_open(BlockDriverState *bs, QDict *options,
 {
     ThrottleGroupMember *tgm = bs->opaque;
     char *group;
+    unsigned int weight;
     int ret;
 
     bs->file = bdrv_open_child(NULL, options, "file", bs,
@@ -91,10 +114,11 @@ static int throttle_open(BlockDriverState *bs, QDict *options,
     bs->supported_zero_flags = bs->file->bs->supported_zero_flags |
                                BDRV_REQ_WRITE_UNCHANGED;
 
-    ret = throttle_parse_options(options, &group, errp);
+    ret = throttle_parse_options(options, &group, &weight, errp);
     if (ret == 0) {
         /* Register membership to group with name group_name */
         throttle_group_register_tgm(tgm, group, bdrv_get_aio_context(bs));
+        throttle_group_set_weight(tgm, weight);
         g_free(group);
     }
 
@@ -175,36 +199,50 @@ static int throttle_reopen_prepare(BDRVReopenState *reopen_state,
                                    BlockReopenQueue *queue, Error **errp)
 {
     int ret;
-    char *group = NULL;
+    ThrottleReopenState *rs = g_new0(ThrottleReopenState, 1);
 
     assert(reopen_state != NULL);
     assert(reopen_state->bs != NULL);
 
-    ret = throttle_parse_options(reopen_state->options, &group, errp);
-    reopen_state->opaque = group;
-    return ret;
+    ret = throttle_parse_options(reopen_state->options, &rs->group,
+                                 &rs->weight, errp);
+    if (ret < 0) {
+        g_free(rs);
+        return ret;
+    }
+
+    reopen_state->opaque = rs;
+    return 0;
+}
+
+static void throttle_reopen_free(BDRVReopenState *reopen_state)
+{
+    ThrottleReopenState *rs = reopen_state->opaque;
+
+    g_free(rs->group);
+    g_free(rs);
+    reopen_state->opaque = NULL;
 }
 
 static void throttle_reopen_commit(BDRVReopenState *reopen_state)
 {
     BlockDriverState *bs = reopen_state->bs;
     ThrottleGroupMember *tgm = bs->opaque;
-    char *group = reopen_state->opaque;
+    ThrottleReopenState *rs = reopen_state->opaque;
 
-    assert(group);
+    assert(rs->group);
 
-    if (strcmp(group, throttle_group_get_name(tgm))) {
+    if (strcmp(rs->group, throttle_group_get_name(tgm))) {
         throttle_group_unregister_tgm(tgm);
-        throttle_group_register_tgm(tgm, group, bdrv_get_aio_context(bs));
+        throttle_group_register_tgm(tgm, rs->group, bdrv_get_aio_context(bs));
     }
-    g_free(reopen_state->opaque);
-    reopen_state->opaque = NULL;
+    throttle_group_set_weight(tgm, rs->weight);
+    throttle_reopen_free(reopen_state);
 }
 
 static void throttle_reopen_abort(BDRVReopenState *reopen_state)
 {
-    g_free(reopen_state->opaque);
-    reopen_state->opaque = NULL;
+    throttle_reopen_free(reopen_state);
 }
 
 static bool throttle_recurse_is_first_non_filter(BlockDriverState *bs,
@@ -146,11 +146,14 @@ void qmp_nbd_server_start(SocketAddressLegacy *addr,
 
 void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
                         bool has_writable, bool writable,
-                        bool has_bitmap, const char *bitmap, Error **errp)
+                        bool has_bitmap, const char *bitmap,
+                        bool has_multi_conn, OnOffAuto multi_conn,
+                        Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
     NBDExport *exp;
+    uint16_t nbdflags = 0;
     int64_t len;
 
     if (!nbd_server) {
@@ -187,9 +190,19 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
     if (bdrv_is_read_only(bs)) {
         writable = false;
     }
+    if (!writable) {
+        nbdflags |= NBD_FLAG_READ_ONLY;
+    }
+
+    if (!has_multi_conn) {
+        multi_conn = ON_OFF_AUTO_AUTO;
+    }
+    if (multi_conn == ON_OFF_AUTO_ON ||
+        (multi_conn == ON_OFF_AUTO_AUTO && !writable)) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
 
-    exp = nbd_export_new(bs, 0, len, name, NULL, bitmap,
-                         writable ? 0 : NBD_FLAG_READ_ONLY,
+    exp = nbd_export_new(bs, 0, len, name, NULL, bitmap, nbdflags,
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
@@ -42,6 +42,22 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * Virtqueue to IOThread mapping.  vq_ctx[i] is the AioContext that
+     * handles notifications for virtqueue i.  Only ioeventfd handling and
+     * virtqueue polling are offloaded to the mapped IOThreads.  The
+     * BlockBackend stays in @ctx: virtqueue processing is serialized by the
+     * lock of @ctx, and requests run and complete in @ctx, which also
+     * notifies the guest.
+     */
+    IOThread **vq_iothreads;
+    unsigned num_vq_iothreads;
+    AioContext **vq_ctx;
+
+    /* Distinct elements of vq_ctx other than @ctx */
+    AioContext **foreign_ctx;
+    unsigned num_foreign_ctx;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -62,8 +78,11 @@ static void notify_guest_bh(void *opaque)
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
+    /* Queues in other IOThreads set bits with the AioContext lock held */
+    aio_context_acquire(s->ctx);
     memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
     memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    aio_context_release(s->ctx);
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
         unsigned long bits = bitmap[j];
@@ -79,6 +98,80 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* Context: QEMU global mutex held */
+static bool virtio_blk_data_plane_map_vqs(VirtIOBlockDataPlane *s,
+                                          VirtIOBlkConf *conf,
+                                          Error **errp)
+{
+    unsigned i, j;
+
+    if (conf->num_vq_iothreads > conf->num_queues) {
+        error_setg(errp, "vq-iothreads has %" PRIu32 " entries, but there "
+                   "are only %" PRIu16 " virtqueues", conf->num_vq_iothreads,
+                   conf->num_queues);
+        return false;
+    }
+
+    s->vq_iothreads = g_new0(IOThread *, conf->num_vq_iothreads);
+    for (i = 0; i < conf->num_vq_iothreads; i++) {
+        IOThread *iothread = iothread_by_id(conf->vq_iothreads[i]);
+
+        if (!iothread) {
+            error_setg(errp, "vq-iothreads[%u]: IOThread '%s' not found",
+                       i, conf->vq_iothreads[i]);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        s->vq_iothreads[s->num_vq_iothreads++] = iothread;
+    }
+
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    s->foreign_ctx = g_new(AioContext *, conf->num_vq_iothreads);
+    for (i = 0; i < conf->num_queues; i++) {
+        AioContext *ctx = s->ctx;
+
+        if (s->num_vq_iothreads) {
+            ctx = iothread_get_aio_context(
+                s->vq_iothreads[i % s->num_vq_iothreads]);
+        }
+        s->vq_ctx[i] = ctx;
+
+        if (ctx == s->ctx) {
+            continue;
+        }
+        for (j = 0; j < s->num_foreign_ctx; j++) {
+            if (s->foreign_ctx[j] == ctx) {
+                break;
+            }
+        }
+        if (j == s->num_foreign_ctx) {
+            s->foreign_ctx[s->num_foreign_ctx++] = ctx;
+        }
+    }
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_blk_data_plane_free(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->num_vq_iothreads; i++) {
+        object_unref(OBJECT(s->vq_iothreads[i]));
+    }
+    g_free(s->vq_iothreads);
+    g_free(s->vq_ctx);
+    g_free(s->foreign_ctx);
+    g_free(s->batch_notify_vqs);
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+    }
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+    }
+    g_free(s);
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -90,7 +183,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread || conf->num_vq_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -123,12 +216,28 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
+    } else if (conf->num_vq_iothreads) {
+        /* The BlockBackend lives in the IOThread of the first virtqueue */
+        s->iothread = iothread_by_id(conf->vq_iothreads[0]);
+        if (!s->iothread) {
+            error_setg(errp, "vq-iothreads[0]: IOThread '%s' not found",
+                       conf->vq_iothreads[0]);
+            virtio_blk_data_plane_free(s);
+            return false;
+        }
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
     } else {
         s->ctx = qemu_get_aio_context();
     }
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
+    if (!virtio_blk_data_plane_map_vqs(s, conf, errp)) {
+        virtio_blk_data_plane_free(s);
+        return false;
+    }
+    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
     *dataplane = s;
 
     return true;
@@ -145,23 +254,76 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
-    }
-    g_free(s);
+    virtio_blk_data_plane_free(s);
 }
 
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+    bool progress = false;
 
     assert(s->dataplane);
     assert(s->dataplane_started);
 
-    return virtio_blk_handle_vq(s, vq);
+    /*
+     * Only ioeventfd handling and polling run in the IOThread that the
+     * virtqueue is mapped to.  Popping and submitting requests is serialized
+     * by the BlockBackend's AioContext lock, so virtqueues that share a disk
+     * do not process requests in parallel, and all completions run in the
+     * BlockBackend's AioContext.
+     *
+     * Virtqueues handled outside of the BlockBackend's AioContext can race
+     * with the start of a drained section while they wait for the lock.
+     * Leave the requests in the ring, drained_end will kick the queue.
+     */
+    aio_context_acquire(ctx);
+    if (!aio_external_disabled(qemu_get_current_aio_context())) {
+        progress = virtio_blk_handle_vq(s, vq);
+    }
+    aio_context_release(ctx);
+    return progress;
+}
+
+/*
+ * The block layer only disables external event sources in the BlockBackend's
+ * AioContext.  Do the same for the other IOThreads that serve virtqueues so
+ * that no new requests are submitted during a drained section.
+ *
+ * Context: drained_begin/drained_end callback of the BlockBackend
+ */
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->num_foreign_ctx; i++) {
+        aio_disable_external(s->foreign_ctx[i]);
+    }
+}
+
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned i;
+
+    for (i = 0; i < s->num_foreign_ctx; i++) {
+        aio_enable_external(s->foreign_ctx[i]);
+    }
+
+    if (!s->num_foreign_ctx || !vblk->dataplane_started ||
+        vblk->dataplane_disabled) {
+        return;
+    }
+
+    /* Pick up requests that arrived while the queues were quiesced */
+    for (i = 0; i < s->conf->num_queues; i++) {
+        if (s->vq_ctx[i] != s->ctx) {
+            VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+            event_notifier_set(virtio_queue_get_host_notifier(vq));
+        }
+    }
 }
 
 /* Context: QEMU global mutex held */
@@ -227,14 +389,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i],
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(s->vq_ctx[i]);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -246,17 +408,20 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
 /* Stop notifications for new requests from guest.
  *
- * Context: BH in IOThread
+ * Context: BH in IOThread, once for each AioContext that serves virtqueues
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_ctx[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -283,6 +448,13 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < s->num_foreign_ctx; i++) {
+        aio_context_acquire(s->foreign_ctx[i]);
+        aio_wait_bh_oneshot(s->foreign_ctx[i], virtio_blk_data_plane_stop_bh,
+                            s);
+        aio_context_release(s->foreign_ctx[i]);
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
@@ -19,10 +19,13 @@
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>, \
  *              cmb_size_mb=<cmb_size_mb[optional]>, \
- *              num_queues=<N[optional]>
+ *              num_queues=<N[optional]>, \
+ *              num_namespaces=<N[optional]>
  *
  * Note cmb_size_mb denotes size of CMB in MB. CMB is assumed to be at
  * offset 0 in BAR2 and supports only WDS, RDS and SQS for now.
+ *
+ * num_namespaces splits the drive into that many namespaces of equal size.
  */
 
 #include "qemu/osdep.h"
@@ -49,16 +52,31 @@
             " in %s: " fmt "\n", __func__, ## __VA_ARGS__); \
     } while (0)
 
+#define NVME_MAX_NAMESPACES 256
+#define NVME_SGL_MAX_SEGMENTS 32
+#define NVME_SGL_MAX_DESCRS 256
+
 static void nvme_process_sq(void *opaque);
 
-static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
+static bool nvme_addr_is_cmb(NvmeCtrl *n, hwaddr addr)
+{
+    return n->cmbsz && addr >= n->ctrl_mem.addr &&
+           addr < (n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size));
+}
+
+/* Fails for reads that start in the CMB but do not end there */
+static int nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
 {
-    if (n->cmbsz && addr >= n->ctrl_mem.addr &&
-                addr < (n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size))) {
+    if (nvme_addr_is_cmb(n, addr)) {
+        if (addr + size < addr || !nvme_addr_is_cmb(n, addr + size - 1)) {
+            trace_nvme_err_addr_read(addr, size);
+            return -1;
+        }
         memcpy(buf, (void *)&n->cmbuf[addr - n->ctrl_mem.addr], size);
     } else {
         pci_dma_read(&n->parent_obj, addr, buf, size);
     }
+    return 0;
 }
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
@@ -169,7 +187,9 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
 
             nents = (len + n->page_size - 1) >> n->page_bits;
             prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-            nvme_addr_read(n, prp2, (void *)prp_list, prp_trans);
+            if (nvme_addr_read(n, prp2, (void *)prp_list, prp_trans)) {
+                goto unmap;
+            }
             while (len != 0) {
                 uint64_t prp_ent = le64_to_cpu(prp_list[i]);
 
@@ -182,8 +202,10 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
                     i = 0;
                     nents = (len + n->page_size - 1) >> n->page_bits;
                     prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-                    nvme_addr_read(n, prp_ent, (void *)prp_list,
-                        prp_trans);
+                    if (nvme_addr_read(n, prp_ent, (void *)prp_list,
+                                       prp_trans)) {
+                        goto unmap;
+                    }
                     prp_ent = le64_to_cpu(prp_list[i]);
                 }
 
@@ -220,6 +242,119 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+/*
+ * Map the data of a command that uses a scatter gather list.  The first
+ * descriptor comes from the command itself; segment descriptors chain to
+ * further lists of descriptors in guest memory.  As with PRPs, the data
+ * must be either all in the controller memory buffer or all outside it.
+ */
+static uint16_t nvme_map_sgl(NvmeCtrl *n, QEMUSGList *qsg, QEMUIOVector *iov,
+                             NvmeSglDescriptor *sgl, uint32_t len)
+{
+    NvmeSglDescriptor *desc = sgl, *list = NULL;
+    uint32_t ndesc = 1, nsegs = 0;
+    bool mapped = false, cmb = false, last_segment = false;
+    uint16_t status;
+    uint32_t i;
+
+    while (len) {
+        for (i = 0; i < ndesc && len; i++) {
+            uint8_t type = NVME_SGL_TYPE(desc[i].type);
+            uint64_t addr = le64_to_cpu(desc[i].addr);
+            uint32_t dlen = le32_to_cpu(desc[i].len);
+
+            if (type == NVME_SGL_DESCR_TYPE_SEGMENT ||
+                type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+                break;
+            }
+            if (type != NVME_SGL_DESCR_TYPE_DATA_BLOCK ||
+                NVME_SGL_SUBTYPE(desc[i].type)) {
+                trace_nvme_err_invalid_sgl_descr_type(desc[i].type);
+                status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+                goto fail;
+            }
+
+            if (dlen > len) {
+                trace_nvme_err_invalid_sgl_data_len(dlen, len);
+                status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+                goto fail;
+            }
+            if (!dlen) {
+                continue;
+            }
+            if (!mapped) {
+                cmb = nvme_addr_is_cmb(n, addr);
+                if (cmb) {
+                    qsg->nsg = 0;
+                    qemu_iovec_init(iov, ndesc);
+                } else {
+                    pci_dma_sglist_init(qsg, &n->parent_obj, ndesc);
+                }
+                mapped = true;
+            }
+            if (nvme_addr_is_cmb(n, addr) != cmb ||
+                (cmb && !nvme_addr_is_cmb(n, addr + dlen - 1))) {
+                trace_nvme_err_invalid_sgl_addr(addr, dlen);
+                status = NVME_INVALID_FIELD | NVME_DNR;
+                goto fail;
+            }
+            if (cmb) {
+                qemu_iovec_add(iov, &n->cmbuf[addr - n->ctrl_mem.addr], dlen);
+            } else {
+                qemu_sglist_add(qsg, addr, dlen);
+            }
+            len -= dlen;
+        }
+
+        if (!len) {
+            break;
+        }
+        if (i == ndesc) {
+            trace_nvme_err_invalid_sgl_len(len);
+            status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+            goto fail;
+        }
+
+        /* desc[i] points to the next segment, it must end the list */
+        if (i != ndesc - 1 || last_segment ||
+            ++nsegs > NVME_SGL_MAX_SEGMENTS) {
+            trace_nvme_err_invalid_sgl_segment(i, ndesc, nsegs);
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto fail;
+        }
+        last_segment = NVME_SGL_TYPE(desc[i].type) ==
+                       NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        ndesc = le32_to_cpu(desc[i].len) / sizeof(NvmeSglDescriptor);
+        if (!ndesc || ndesc > NVME_SGL_MAX_DESCRS ||
+            le32_to_cpu(desc[i].len) % sizeof(NvmeSglDescriptor)) {
+            trace_nvme_err_invalid_sgl_segment(i, ndesc, nsegs);
+            status = NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR;
+            goto fail;
+        }
+        list = g_renew(NvmeSglDescriptor, list, ndesc);
+        if (nvme_addr_read(n, le64_to_cpu(desc[i].addr), list,
+                           ndesc * sizeof(NvmeSglDescriptor))) {
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto fail;
+        }
+        desc = list;
+    }
+
+    g_free(list);
+    return NVME_SUCCESS;
+
+fail:
+    g_free(list);
+    if (mapped) {
+        if (cmb) {
+            qemu_iovec_destroy(iov);
+        } else {
+            qemu_sglist_destroy(qsg);
+        }
+    }
+    return status;
+}
+
 static uint16_t nvme_dma_write_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
                                    uint64_t prp1, uint64_t prp2)
 {
@@ -272,17 +407,77 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return status;
 }
 
+/*
+ * With the Doorbell Buffer Config feature the guest writes new queue
+ * tails and heads to a shadow doorbell buffer in its memory, and only
+ * writes the MMIO doorbell when the value moves past the EventIdx that
+ * the controller published in a second buffer.
+ */
+static void nvme_sq_update_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &tail, sizeof(tail));
+    tail = le32_to_cpu(tail);
+    if (unlikely(tail >= sq->size)) {
+        NVME_GUEST_ERR(nvme_ub_dbbuf_invalid_sqtail,
+                       "shadow doorbell value beyond queue size,"
+                       " sqid=%"PRIu16", new_tail=%"PRIu32", ignoring",
+                       sq->sqid, tail);
+        return;
+    }
+    sq->tail = tail;
+}
+
+static void nvme_sq_update_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_cq_update_head(NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &head, sizeof(head));
+    head = le32_to_cpu(head);
+    if (unlikely(head >= cq->size)) {
+        NVME_GUEST_ERR(nvme_ub_dbbuf_invalid_cqhead,
+                       "shadow doorbell value beyond queue size,"
+                       " cqid=%"PRIu16", new_head=%"PRIu32", ignoring",
+                       cq->cqid, head);
+        return;
+    }
+    cq->head = head;
+}
+
+static void nvme_cq_update_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
 static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    NvmeSQueue *sq;
+
+    if (cq->db_addr) {
+        nvme_cq_update_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
-        NvmeSQueue *sq;
         hwaddr addr;
 
         if (nvme_cq_full(cq)) {
+            if (cq->db_addr) {
+                /* Have the guest ring once it consumes an entry */
+                nvme_cq_update_eventidx(cq);
+            }
             break;
         }
 
@@ -299,6 +494,28 @@ static void nvme_post_cqes(void *opaque)
     }
     if (cq->tail != cq->head) {
         nvme_irq_assert(n, cq);
+        if (cq->db_addr && !msix_enabled(&n->parent_obj)) {
+            /*
+             * Only a doorbell write deasserts the pin, so have the guest
+             * ring once it consumed the last entry.
+             */
+            uint32_t v = cpu_to_le32((cq->tail + cq->size - 1) % cq->size);
+
+            pci_dma_write(&n->parent_obj, cq->ei_addr, &v, sizeof(v));
+        }
+    } else {
+        /* The head may have moved in the shadow doorbell */
+        nvme_irq_deassert(n, cq);
+    }
+
+    /*
+     * Submissions that the guest did not announce with a doorbell write
+     * may be waiting for the requests that were just freed.
+     */
+    QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+        if (sq->db_addr) {
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
     }
 }
 
@@ -349,7 +566,7 @@ static uint16_t nvme_write_zeros(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
     uint64_t slba = le64_to_cpu(rw->slba);
     uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
-    uint64_t offset = slba << data_shift;
+    uint64_t offset = ns->start + (slba << data_shift);
     uint32_t count = nlb << data_shift;
 
     if (unlikely(slba + nlb > ns->id_ns.nsze)) {
@@ -377,7 +594,8 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
     uint64_t data_size = (uint64_t)nlb << data_shift;
-    uint64_t data_offset = slba << data_shift;
+    uint64_t data_offset = ns->start + (slba << data_shift);
+    uint16_t status;
     int is_write = rw->opcode == NVME_CMD_WRITE ? 1 : 0;
     enum BlockAcctType acct = is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ;
 
@@ -389,9 +607,22 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, &req->iov, prp1, prp2, data_size, n)) {
+    switch (NVME_CMD_FLAGS_PSDT(rw->flags)) {
+    case NVME_PSDT_PRP:
+        status = nvme_map_prp(&req->qsg, &req->iov, prp1, prp2, data_size, n);
+        break;
+    case NVME_PSDT_SGL_MPTR_CONTIG:
+    case NVME_PSDT_SGL_MPTR_SGL:
+        status = nvme_map_sgl(n, &req->qsg, &req->iov,
+                              (NvmeSglDescriptor *)&rw->prp1, data_size);
+        break;
+    default:
+        status = NVME_INVALID_FIELD | NVME_DNR;
+        break;
+    }
+    if (status) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        return status;
     }
 
     dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
@@ -439,6 +670,31 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+/*
+ * The shadow doorbell and EventIdx of each queue are at the same offset in
+ * their buffers as the MMIO doorbell is in the doorbell registers.  The
+ * admin queue keeps using MMIO doorbells only.
+ */
+static void nvme_sq_set_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    nvme_sq_update_eventidx(sq);
+}
+
+static void nvme_cq_set_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+    nvme_cq_update_eventidx(cq);
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
@@ -509,6 +765,10 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
     sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->db_addr = sq->ei_addr = 0;
+    if (sqid && n->dbbuf_dbs) {
+        nvme_sq_set_dbbuf(n, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
@@ -603,6 +863,10 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->db_addr = cq->ei_addr = 0;
+    if (cqid && n->dbbuf_dbs) {
+        nvme_cq_set_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -843,6 +1107,33 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    trace_nvme_dbbuf_config(dbs_addr, eis_addr);
+
+    if (unlikely(!dbs_addr || !eis_addr ||
+                 (dbs_addr | eis_addr) & (n->page_size - 1))) {
+        trace_nvme_err_invalid_dbbuf(dbs_addr, eis_addr);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_sq_set_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_cq_set_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -860,6 +1151,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         trace_nvme_err_invalid_admin_opc(cmd->opcode);
         return NVME_INVALID_OPCODE | NVME_DNR;
@@ -877,9 +1170,15 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_sq_update_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
-        nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
+        if (nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd))) {
+            break;
+        }
         nvme_inc_sq_head(sq);
 
         req = QTAILQ_FIRST(&sq->req_list);
@@ -894,6 +1193,16 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr && nvme_sq_empty(sq)) {
+            /*
+             * Ask for a doorbell write on the next submission, then look
+             * for submissions that raced with the EventIdx update.
+             */
+            nvme_sq_update_eventidx(sq);
+            smp_mb(); /* order the EventIdx write before the tail read */
+            nvme_sq_update_tail(sq);
+        }
     }
 }
 
@@ -916,6 +1225,7 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 
     blk_flush(n->conf.blk);
     n->bar.cc = 0;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -1316,6 +1626,12 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         return;
     }
 
+    if (!n->num_namespaces || n->num_namespaces > NVME_MAX_NAMESPACES) {
+        error_setg(errp, "num_namespaces must be between 1 and %d",
+                   NVME_MAX_NAMESPACES);
+        return;
+    }
+
     if (!n->conf.blk) {
         error_setg(errp, "drive property not set");
         return;
@@ -1343,9 +1659,14 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     pci_config_set_class(pci_dev->config, PCI_CLASS_STORAGE_EXPRESS);
     pcie_endpoint_cap_init(pci_dev, 0x80);
 
-    n->num_namespaces = 1;
     n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
-    n->ns_size = bs_size / (uint64_t)n->num_namespaces;
+    n->ns_size = QEMU_ALIGN_DOWN(bs_size / (uint64_t)n->num_namespaces,
+                                 BDRV_SECTOR_SIZE);
+    if (!n->ns_size) {
+        error_setg(errp, "drive is too small for %" PRIu32 " namespaces",
+                   n->num_namespaces);
+        return;
+    }
 
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
@@ -1367,13 +1688,15 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
     id->oncs = cpu_to_le16(NVME_ONCS_WRITE_ZEROS | NVME_ONCS_TIMESTAMP);
+    /* SGLs supported, no alignment or granularity requirement */
+    id->sgls = cpu_to_le32(0x1);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -1427,6 +1750,7 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         id_ns->dpc = 0;
         id_ns->dps = 0;
         id_ns->lbaf[0].ds = BDRV_SECTOR_BITS;
+        ns->start = i * n->ns_size;
         id_ns->ncap  = id_ns->nuse = id_ns->nsze =
             cpu_to_le64(n->ns_size >>
                 id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
@@ -1453,6 +1777,7 @@ static Property nvme_props[] = {
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
     DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
     DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_UINT32("num_namespaces", NvmeCtrl, num_namespaces, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
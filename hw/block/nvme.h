@@ -27,6 +27,8 @@ typedef struct NvmeSQueue {
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
+    uint64_t    db_addr;    /* shadow tail doorbell, 0 if not in use */
+    uint64_t    ei_addr;    /* tail EventIdx */
     QEMUTimer   *timer;
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
@@ -44,6 +46,8 @@ typedef struct NvmeCQueue {
     uint32_t    vector;
     uint32_t    size;
     uint64_t    dma_addr;
+    uint64_t    db_addr;    /* shadow head doorbell, 0 if not in use */
+    uint64_t    ei_addr;    /* head EventIdx */
     QEMUTimer   *timer;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
@@ -51,6 +55,7 @@ typedef struct NvmeCQueue {
 
 typedef struct NvmeNamespace {
     NvmeIdNs        id_ns;
+    uint64_t        start;  /* byte offset of the namespace in the drive */
 } NvmeNamespace;
 
 #define TYPE_NVME "nvme"
@@ -81,6 +86,8 @@ typedef struct NvmeCtrl {
     uint64_t    irq_status;
     uint64_t    host_timestamp;                 /* Timestamp sent by the host */
     uint64_t    timestamp_set_qemu_clock_ms;    /* QEMU clock time */
+    uint64_t    dbbuf_dbs;                      /* Shadow doorbell buffer */
+    uint64_t    dbbuf_eis;                      /* EventIdx buffer */
 
     char            *serial;
     NvmeNamespace   *namespaces;
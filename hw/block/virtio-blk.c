@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/iov.h"
+#include "qemu/units.h"
 #include "qemu/module.h"
 #include "qemu/error-report.h"
 #include "trace.h"
@@ -171,25 +172,29 @@ out:
 
 static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
 {
-    VirtIOBlockReq *req = opaque;
-    VirtIOBlock *s = req->dev;
-    bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &req->out.type) &
+    VirtIOBlockReq *next = opaque;
+    VirtIOBlock *s = next->dev;
+    bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &next->out.type) &
                             ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
-    if (ret) {
-        if (virtio_blk_handle_rw_error(req, -ret, false, is_write_zeroes)) {
-            goto out;
+    while (next) {
+        VirtIOBlockReq *req = next;
+        next = req->mr_next;
+
+        if (ret) {
+            if (virtio_blk_handle_rw_error(req, -ret, false,
+                                           is_write_zeroes)) {
+                continue;
+            }
         }
-    }
 
-    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-    if (is_write_zeroes) {
-        block_acct_done(blk_get_stats(s->blk), &req->acct);
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        if (is_write_zeroes) {
+            block_acct_done(blk_get_stats(s->blk), &req->acct);
+        }
+        virtio_blk_free_request(req);
     }
-    virtio_blk_free_request(req);
-
-out:
     aio_context_release(blk_get_aio_context(s->conf.conf.blk));
 }
 
@@ -442,7 +447,7 @@ static int multireq_compare(const void *a, const void *b)
 static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
 {
     int i = 0, start = 0, num_reqs = 0, niov = 0, nb_sectors = 0;
-    uint32_t max_transfer;
+    uint64_t max_transfer;
     int64_t sector_num = 0;
 
     if (mrb->num_reqs == 1) {
@@ -451,7 +456,17 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
         return;
     }
 
-    max_transfer = blk_get_max_transfer(mrb->reqs[0]->dev->blk);
+    /*
+     * The block layer splits requests at max_transfer, which is harmless
+     * for reads.  A merged write however must not be split in a way that
+     * tears one of the guest's writes in two, so keep writes within the
+     * limit.
+     */
+    if (mrb->is_write) {
+        max_transfer = blk_get_max_transfer(mrb->reqs[0]->dev->blk);
+    } else {
+        max_transfer = BDRV_REQUEST_MAX_BYTES;
+    }
 
     qsort(mrb->reqs, mrb->num_reqs, sizeof(*mrb->reqs),
           &multireq_compare);
@@ -490,6 +505,77 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     mrb->num_reqs = 0;
 }
 
+/* Submit the discard or write zeroes requests collected in @mrb at once */
+static void virtio_blk_submit_dwz(VirtIOBlock *s, MultiReqBuffer *mrb)
+{
+    VirtIOBlockReq *req = mrb->dwz_head;
+    int64_t offset = mrb->dwz_sector << BDRV_SECTOR_BITS;
+    int bytes = mrb->dwz_nb_sectors << BDRV_SECTOR_BITS;
+
+    if (!req) {
+        return;
+    }
+    mrb->dwz_head = mrb->dwz_tail = NULL;
+
+    if (mrb->dwz_num_reqs > 1) {
+        trace_virtio_blk_submit_dwz(VIRTIO_DEVICE(s), mrb, mrb->dwz_num_reqs,
+                                    offset, bytes, mrb->dwz_is_write_zeroes);
+        if (mrb->dwz_is_write_zeroes) {
+            block_acct_merge_done(blk_get_stats(s->blk), BLOCK_ACCT_WRITE,
+                                  mrb->dwz_num_reqs - 1);
+        }
+    }
+
+    if (mrb->dwz_is_write_zeroes) {
+        int blk_aio_flags = 0;
+
+        if (mrb->dwz_flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) {
+            blk_aio_flags |= BDRV_REQ_MAY_UNMAP;
+        }
+        blk_aio_pwrite_zeroes(s->blk, offset, bytes, blk_aio_flags,
+                              virtio_blk_discard_write_zeroes_complete, req);
+    } else {
+        blk_aio_pdiscard(s->blk, offset, bytes,
+                         virtio_blk_discard_write_zeroes_complete, req);
+    }
+}
+
+/*
+ * Guests split large discards and write zeroes requests, for example when
+ * they trim a whole filesystem.  Collect requests of the same kind that
+ * continue each other so that the backend sees a single request.
+ */
+static void virtio_blk_queue_dwz(VirtIOBlockReq *req, MultiReqBuffer *mrb,
+                                 uint64_t sector, uint32_t num_sectors,
+                                 uint32_t flags, bool is_write_zeroes)
+{
+    VirtIOBlock *s = req->dev;
+
+    if (mrb->dwz_head &&
+        (!s->conf.request_merging ||
+         mrb->dwz_num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
+         is_write_zeroes != mrb->dwz_is_write_zeroes ||
+         flags != mrb->dwz_flags ||
+         sector != mrb->dwz_sector + mrb->dwz_nb_sectors ||
+         num_sectors > BDRV_REQUEST_MAX_SECTORS - mrb->dwz_nb_sectors)) {
+        virtio_blk_submit_dwz(s, mrb);
+    }
+
+    if (!mrb->dwz_head) {
+        mrb->dwz_head = req;
+        mrb->dwz_num_reqs = 0;
+        mrb->dwz_sector = sector;
+        mrb->dwz_nb_sectors = 0;
+        mrb->dwz_flags = flags;
+        mrb->dwz_is_write_zeroes = is_write_zeroes;
+    } else {
+        mrb->dwz_tail->mr_next = req;
+    }
+    mrb->dwz_tail = req;
+    mrb->dwz_num_reqs++;
+    mrb->dwz_nb_sectors += num_sectors;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     VirtIOBlock *s = req->dev;
@@ -503,6 +589,7 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     if (mrb->is_write && mrb->num_reqs > 0) {
         virtio_blk_submit_multireq(s->blk, mrb);
     }
+    virtio_blk_submit_dwz(s, mrb);
     blk_aio_flush(s->blk, virtio_blk_flush_complete, req);
 }
 
@@ -529,7 +616,8 @@ static bool virtio_blk_sect_range_ok(VirtIOBlock *dev,
 }
 
 static uint8_t virtio_blk_handle_discard_write_zeroes(VirtIOBlockReq *req,
-    struct virtio_blk_discard_write_zeroes *dwz_hdr, bool is_write_zeroes)
+    struct virtio_blk_discard_write_zeroes *dwz_hdr, bool is_write_zeroes,
+    MultiReqBuffer *mrb)
 {
     VirtIOBlock *s = req->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
@@ -571,18 +659,8 @@ static uint8_t virtio_blk_handle_discard_write_zeroes(VirtIOBlockReq *req,
     }
 
     if (is_write_zeroes) { /* VIRTIO_BLK_T_WRITE_ZEROES */
-        int blk_aio_flags = 0;
-
-        if (flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) {
-            blk_aio_flags |= BDRV_REQ_MAY_UNMAP;
-        }
-
         block_acct_start(blk_get_stats(s->blk), &req->acct, bytes,
                          BLOCK_ACCT_WRITE);
-
-        blk_aio_pwrite_zeroes(s->blk, sector << BDRV_SECTOR_BITS,
-                              bytes, blk_aio_flags,
-                              virtio_blk_discard_write_zeroes_complete, req);
     } else { /* VIRTIO_BLK_T_DISCARD */
         /*
          * The device MUST set the status byte to VIRTIO_BLK_S_UNSUPP for
@@ -592,11 +670,10 @@ static uint8_t virtio_blk_handle_discard_write_zeroes(VirtIOBlockReq *req,
             err_status = VIRTIO_BLK_S_UNSUPP;
             goto err;
         }
-
-        blk_aio_pdiscard(s->blk, sector << BDRV_SECTOR_BITS, bytes,
-                         virtio_blk_discard_write_zeroes_complete, req);
     }
 
+    virtio_blk_queue_dwz(req, mrb, sector, num_sectors, flags,
+                         is_write_zeroes);
     return VIRTIO_BLK_S_OK;
 
 err:
@@ -740,7 +817,8 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         }
 
         err_status = virtio_blk_handle_discard_write_zeroes(req, &dwz_hdr,
-                                                            is_write_zeroes);
+                                                            is_write_zeroes,
+                                                            mrb);
         if (err_status != VIRTIO_BLK_S_OK) {
             virtio_blk_req_complete(req, err_status);
             virtio_blk_free_request(req);
@@ -755,21 +833,117 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     return 0;
 }
 
+/*
+ * With merge-window-us set, the reads or writes that are left at the end of
+ * a virtqueue pass may be held back for that long, so that they can be
+ * merged with requests that the guest submits with its next kicks.  Held
+ * requests count as in flight, so that draining waits for them.
+ */
+typedef struct VirtIOBlockMergeWindow {
+    VirtIOBlock *s;
+    MultiReqBuffer mrb;
+    QEMUTimer *timer;
+    AioContext *ctx;    /* where @timer was created */
+    int64_t deadline;
+    bool held;
+} VirtIOBlockMergeWindow;
+
+static void virtio_blk_merge_window_release(VirtIOBlockMergeWindow *mw)
+{
+    if (mw->held) {
+        timer_del(mw->timer);
+        mw->held = false;
+        blk_dec_in_flight(mw->s->blk);
+    }
+}
+
+static void virtio_blk_merge_window_cb(void *opaque)
+{
+    VirtIOBlockMergeWindow *mw = opaque;
+    VirtIOBlock *s = mw->s;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    aio_context_acquire(ctx);
+    if (mw->held) {
+        trace_virtio_blk_merge_window_expire(VIRTIO_DEVICE(s), &mw->mrb,
+                                             mw->mrb.num_reqs);
+        blk_io_plug(s->blk);
+        if (mw->mrb.num_reqs) {
+            virtio_blk_submit_multireq(s->blk, &mw->mrb);
+        }
+        blk_io_unplug(s->blk);
+        virtio_blk_merge_window_release(mw);
+    }
+    aio_context_release(ctx);
+}
+
+/* Called at the end of a virtqueue pass to submit or hold the requests */
+static void virtio_blk_merge_window_update(VirtIOBlockMergeWindow *mw)
+{
+    VirtIOBlock *s = mw->s;
+    MultiReqBuffer *mrb = &mw->mrb;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t bytes = 0;
+    unsigned int i;
+
+    for (i = 0; i < mrb->num_reqs; i++) {
+        bytes += mrb->reqs[i]->qiov.size;
+    }
+
+    if (mrb->num_reqs &&
+        (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
+         bytes >= s->conf.merge_window_max_bytes ||
+         (mw->held && now >= mw->deadline))) {
+        virtio_blk_submit_multireq(s->blk, mrb);
+    }
+
+    if (!mrb->num_reqs) {
+        virtio_blk_merge_window_release(mw);
+        return;
+    }
+
+    if (!mw->held) {
+        AioContext *ctx = blk_get_aio_context(s->blk);
+
+        if (mw->ctx != ctx) {
+            if (mw->timer) {
+                timer_free(mw->timer);
+            }
+            mw->timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                      virtio_blk_merge_window_cb, mw);
+            mw->ctx = ctx;
+        }
+        trace_virtio_blk_merge_window_hold(VIRTIO_DEVICE(s), mrb,
+                                           mrb->num_reqs, bytes);
+        mw->deadline = now + s->conf.merge_window_us * SCALE_US;
+        mw->held = true;
+        blk_inc_in_flight(s->blk);
+        timer_mod(mw->timer, mw->deadline);
+    }
+}
+
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    VirtIOBlockMergeWindow *mw = NULL;
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = &local_mrb;
     bool progress = false;
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_io_plug(s->blk);
 
+    if (s->merge_windows) {
+        mw = &s->merge_windows[virtio_get_queue_index(vq)];
+        mrb = &mw->mrb;
+    }
+
     do {
         virtio_queue_set_notification(vq, 0);
 
         while ((req = virtio_blk_get_request(s, vq))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
+            if (virtio_blk_handle_request(req, mrb)) {
                 virtqueue_detach_element(req->vq, &req->elem, 0);
                 virtio_blk_free_request(req);
                 break;
@@ -779,8 +953,11 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         virtio_queue_set_notification(vq, 1);
     } while (!virtio_queue_empty(vq));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    virtio_blk_submit_dwz(s, mrb);
+    if (mw) {
+        virtio_blk_merge_window_update(mw);
+    } else if (mrb->num_reqs) {
+        virtio_blk_submit_multireq(s->blk, mrb);
     }
 
     blk_io_unplug(s->blk);
@@ -838,6 +1015,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
         req = next;
     }
 
+    virtio_blk_submit_dwz(s, &mrb);
     if (mrb.num_reqs) {
         virtio_blk_submit_multireq(s->blk, &mrb);
     }
@@ -1047,7 +1225,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -1089,8 +1267,28 @@ static void virtio_blk_resize(void *opaque)
     virtio_notify_config(vdev);
 }
 
+static void virtio_blk_drained_begin(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_drained_begin(s->dataplane);
+    }
+}
+
+static void virtio_blk_drained_end(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_drained_end(s->dataplane);
+    }
+}
+
 static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
+    .drained_begin = virtio_blk_drained_begin,
+    .drained_end = virtio_blk_drained_end,
 };
 
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
@@ -1159,6 +1357,17 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (conf->merge_window_us > VIRTIO_BLK_MAX_MERGE_WINDOW_US) {
+        error_setg(errp, "invalid merge-window-us property (%" PRIu32 ")"
+                   ", must be at most %d", conf->merge_window_us,
+                   VIRTIO_BLK_MAX_MERGE_WINDOW_US);
+        return;
+    }
+    if (conf->merge_window_us && !conf->request_merging) {
+        error_setg(errp, "merge-window-us requires request-merging");
+        return;
+    }
+
     virtio_blk_set_config_size(s, s->host_features);
 
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
@@ -1170,9 +1379,17 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     for (i = 0; i < conf->num_queues; i++) {
         virtio_add_queue(vdev, conf->queue_size, virtio_blk_handle_output);
     }
+    if (conf->merge_window_us) {
+        s->merge_windows = g_new0(VirtIOBlockMergeWindow, conf->num_queues);
+        for (i = 0; i < conf->num_queues; i++) {
+            s->merge_windows[i].s = s;
+        }
+    }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        g_free(s->merge_windows);
+        s->merge_windows = NULL;
         virtio_cleanup(vdev);
         return;
     }
@@ -1188,7 +1405,20 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
+    unsigned i;
+
+    if (s->merge_windows) {
+        for (i = 0; i < s->conf.num_queues; i++) {
+            VirtIOBlockMergeWindow *mw = &s->merge_windows[i];
 
+            assert(!mw->held);
+            if (mw->timer) {
+                timer_free(mw->timer);
+            }
+        }
+        g_free(s->merge_windows);
+        s->merge_windows = NULL;
+    }
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
@@ -1232,6 +1462,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 128),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_ARRAY("vq-iothreads", VirtIOBlock, conf.num_vq_iothreads,
+                      conf.vq_iothreads, qdev_prop_string, char *),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
@@ -1240,6 +1472,10 @@ static Property virtio_blk_properties[] = {
                        conf.max_discard_sectors, BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_UINT32("max-write-zeroes-sectors", VirtIOBlock,
                        conf.max_write_zeroes_sectors, BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("merge-window-us", VirtIOBlock, conf.merge_window_us,
+                       0),
+    DEFINE_PROP_UINT32("merge-window-max-bytes", VirtIOBlock,
+                       conf.merge_window_max_bytes, 256 * KiB),
     DEFINE_PROP_END_OF_LIST(),
 };
 
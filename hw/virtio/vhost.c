@@ -1001,7 +1001,10 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
 
     vq->desc_size = s = l = virtio_queue_get_desc_size(vdev, idx);
     vq->desc_phys = a;
-    vq->desc = vhost_memory_map(dev, a, &l, 0);
+    /* Used descriptors are written back into a packed descriptor ring. */
+    vq->desc = vhost_memory_map(dev, a, &l,
+                                virtio_vdev_has_feature(vdev,
+                                                        VIRTIO_F_RING_PACKED));
     if (!vq->desc || l != s) {
         r = -ENOMEM;
         goto fail_alloc_desc;
@@ -1116,7 +1119,8 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     vhost_memory_unmap(dev, vq->avail, virtio_queue_get_avail_size(vdev, idx),
                        0, virtio_queue_get_avail_size(vdev, idx));
     vhost_memory_unmap(dev, vq->desc, virtio_queue_get_desc_size(vdev, idx),
-                       0, virtio_queue_get_desc_size(vdev, idx));
+                       virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED),
+                       virtio_queue_get_desc_size(vdev, idx));
 }
 
 static void vhost_eventfd_add(MemoryListener *listener,
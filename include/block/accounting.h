@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -39,6 +40,14 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/* Stages of a request that are timed at the BlockBackend level */
+enum BlockAcctStage {
+    BLOCK_ACCT_STAGE_DEVICE,
+    BLOCK_ACCT_STAGE_QUEUE,
+    BLOCK_ACCT_STAGE_THROTTLE,
+    BLOCK_MAX_ACCT_STAGE,
+};
+
 struct BlockAcctTimedStats {
     BlockAcctStats *stats;
     TimedAverage latency[BLOCK_MAX_IOTYPE];
@@ -76,6 +85,26 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/*
+ * Always-on latency log.  Samples are sorted into logarithmic buckets with
+ * 2^BLOCK_LATENCY_LOG_SUB_BITS buckets per power of two, so that percentiles
+ * can be extracted with a bounded relative error and without any
+ * configuration.  All fields are updated with atomic operations, which
+ * makes it cheap enough to be used in the I/O path.
+ */
+#define BLOCK_LATENCY_LOG_SUB_BITS 2
+#define BLOCK_LATENCY_LOG_MAX_BITS 40
+#define BLOCK_LATENCY_LOG_BUCKETS \
+    ((BLOCK_LATENCY_LOG_MAX_BITS - BLOCK_LATENCY_LOG_SUB_BITS + 1) << \
+     BLOCK_LATENCY_LOG_SUB_BITS)
+
+typedef struct BlockLatencyLog {
+    Stat64 count;
+    Stat64 total_ns;
+    Stat64 max_ns;
+    Stat64 buckets[BLOCK_LATENCY_LOG_BUCKETS];
+} BlockLatencyLog;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -89,6 +118,7 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    BlockLatencyLog stage_latency[BLOCK_MAX_ACCT_STAGE][BLOCK_MAX_IOTYPE];
 };
 
 typedef struct BlockAcctCookie {
@@ -117,5 +147,9 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+int64_t block_acct_clock_ns(void);
+void block_latency_log_add(BlockLatencyLog *log, uint64_t latency_ns);
+void block_latency_log_account(BlockLatencyLog *log, int64_t start_ns);
+uint64_t block_latency_log_percentile(BlockLatencyLog *log, unsigned permille);
 
 #endif
@@ -121,6 +121,7 @@ typedef struct HDGeometry {
                                       ignoring the format layer */
 #define BDRV_O_NO_IO       0x10000 /* don't initialize for I/O */
 #define BDRV_O_AUTO_RDONLY 0x20000 /* degrade to read-only if opening read-write fails */
+#define BDRV_O_IO_URING    0x40000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_NO_FLUSH)
 
@@ -296,6 +297,7 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top,
 void bdrv_replace_node(BlockDriverState *from, BlockDriverState *to,
                        Error **errp);
 
+int bdrv_parse_aio(const char *mode, int *flags);
 int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough);
 int bdrv_parse_discard_flags(const char *mode, int *flags);
 BdrvChild *bdrv_open_child(const char *filename,
@@ -496,6 +498,7 @@ int bdrv_get_flags(BlockDriverState *bs);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
                                           Error **errp);
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t offset, int64_t bytes,
                             int64_t *cluster_offset,
@@ -729,4 +732,30 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
                                     BdrvChild *dst, uint64_t dst_offset,
                                     uint64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
+
+/**
+ *
+ * bdrv_co_splice_read:
+ *
+ * Read data from @child into the pipe @pipe_fd, without copying it through
+ * a userspace buffer (e.g. with splice(2)).  The caller can then move the
+ * data on from the pipe, again without copying it.
+ *
+ * The pipe must be non-blocking and have room for @bytes; this never waits
+ * for the pipe to drain.
+ *
+ * @child: Child to read data from
+ * @offset: offset in @child image to read data
+ * @bytes: number of bytes to read; 0 only checks whether the driver and the
+ *         backend storage support this
+ * @pipe_fd: write end of the pipe that receives the data
+ *
+ * Returns: 0 if succeeded; -ENOTSUP if the driver or the backend storage
+ * cannot read the data this way, in which case nothing was written to
+ * @pipe_fd and the caller should fall back to a buffered read; any other
+ * negative error code if failed, in which case part of the data may have
+ * been written to @pipe_fd.
+ **/
+int coroutine_fn bdrv_co_splice_read(BdrvChild *child, int64_t offset,
+                                     unsigned int bytes, int pipe_fd);
 #endif
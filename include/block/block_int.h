@@ -58,6 +58,9 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_REPAIR_LOG        "repair_log"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -275,6 +278,18 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Map [offset, offset + bytes) onto a child of @bs and invoke
+     * bdrv_co_splice_read(child, ...), or move the data into @pipe_fd if
+     * @bs is the leaf that holds it.
+     *
+     * See the comment of bdrv_co_splice_read for the parameter and return
+     * value semantics.
+     */
+    int coroutine_fn (*bdrv_co_splice_read)(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            int pipe_fd);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -358,6 +373,7 @@ struct BlockDriver {
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs,
                                                  Error **errp);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -851,6 +867,13 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /*
+     * Latency of the requests processed by this node, measured over the
+     * whole generic block layer path and over the driver callbacks only.
+     */
+    BlockLatencyLog request_latency[BLOCK_MAX_IOTYPE];
+    BlockLatencyLog driver_latency[BLOCK_MAX_IOTYPE];
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -56,8 +56,18 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /*
+     * Share of the group's I/O when several members compete for it, and
+     * the service received so far scaled by the inverse of that share.
+     */
+    unsigned int   weight;
+    uint64_t       vtime[2];
+
 } ThrottleGroupMember;
 
+#define THROTTLE_GROUP_WEIGHT_DEFAULT 100
+#define THROTTLE_GROUP_WEIGHT_MAX     10000
+
 #define TYPE_THROTTLE_GROUP "throttle-group"
 #define THROTTLE_GROUP(obj) OBJECT_CHECK(ThrottleGroup, (obj), TYPE_THROTTLE_GROUP)
 
@@ -73,6 +83,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
                                 const char *groupname,
                                 AioContext *ctx);
 void throttle_group_unregister_tgm(ThrottleGroupMember *tgm);
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned int weight);
 void throttle_group_restart_tgm(ThrottleGroupMember *tgm);
 
 void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm,
@@ -34,15 +34,21 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    /* Ioeventfd and poll offload only, see multiple-iothreads.txt */
+    uint32_t num_vq_iothreads;
+    char **vq_iothreads;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
     uint16_t queue_size;
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
+    uint32_t merge_window_us;
+    uint32_t merge_window_max_bytes;
 };
 
 struct VirtIOBlockDataPlane;
+struct VirtIOBlockMergeWindow;
 
 struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
@@ -59,6 +65,7 @@ typedef struct VirtIOBlock {
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
+    struct VirtIOBlockMergeWindow *merge_windows;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -76,11 +83,21 @@ typedef struct VirtIOBlockReq {
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
+#define VIRTIO_BLK_MAX_MERGE_WINDOW_US 1000
 
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
     bool is_write;
+
+    /* Contiguous discard or write zeroes requests, chained by mr_next */
+    VirtIOBlockReq *dwz_head;
+    VirtIOBlockReq *dwz_tail;
+    unsigned int dwz_num_reqs;
+    uint64_t dwz_sector;
+    uint64_t dwz_nb_sectors;
+    uint32_t dwz_flags;
+    bool dwz_is_write_zeroes;
 } MultiReqBuffer;
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
@@ -48,6 +48,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* zero copy sendmsg() calls issued and completed by the kernel */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
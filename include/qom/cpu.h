@@ -269,6 +269,7 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
@@ -340,6 +341,8 @@ struct qemu_work_item;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty ring of this vCPU when KVM dirty rings are in use.
+ * @kvm_fetch_index: Index of the next dirty ring entry to harvest.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -424,6 +427,8 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -443,6 +448,10 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle of this vcpu alone, on top of the global one */
+    int vcpu_throttle_percentage;
+    /* Pages dirtied by this vcpu, as harvested from its KVM dirty ring */
+    uint64_t dirty_pages;
 
     bool ignore_memory_transaction_failures;
 
@@ -852,6 +861,34 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Like cpu_throttle_set, but only throttles @cpu.  When both a global and
+ * a per-vcpu throttle are set, the larger one applies.  The throttle
+ * remains in effect until cpu_throttle_stop is called.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to query.
+ *
+ * Returns: The throttle percentage set for @cpu by cpu_throttle_set_vcpu,
+ * or 0 if it is not throttled on its own.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
+/**
+ * cpu_throttle_get_max:
+ *
+ * Returns: The largest throttle percentage that applies to any vcpu,
+ * global or per-vcpu, or 0 if no vcpu is throttled.
+ */
+int cpu_throttle_get_max(void);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
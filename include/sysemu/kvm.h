@@ -239,6 +239,14 @@ bool kvm_arm_supports_user_irq(void);
  */
 bool kvm_memcrypt_enabled(void);
 
+/**
+ * kvm_dirty_ring_enabled - return boolean indicating whether dirty pages
+ *                          are tracked with per-vCPU dirty rings
+ * Returns: 1 dirty rings are in use, CPUState::dirty_pages is accounted
+ *          0 dirty pages are tracked with the dirty log bitmap
+ */
+bool kvm_dirty_ring_enabled(void);
+
 /**
  * kvm_memcrypt_encrypt_data: encrypt the memory range
  *
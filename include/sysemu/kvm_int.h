@@ -18,6 +18,8 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    /* ram_addr_t of the start of the slot, used to feed dirty rings */
+    ram_addr_t ram_start_offset;
     int slot;
     int flags;
     int old_flags;
@@ -0,0 +1,352 @@
+/*
+ * Dirty page rate estimation
+ *
+ * Estimate how fast the guest dirties its memory without starting a
+ * migration: hash a random sample of the pages of every RAM block, wait,
+ * hash them again and extrapolate the fraction of changed pages to the
+ * whole RAM.  Unlike the dirty log, this has no effect on the guest.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include <zlib.h>
+#include "qapi/error.h"
+#include "qemu/units.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+#include "qapi/qapi-commands-migration.h"
+#include "ram.h"
+#include "trace.h"
+#include "dirtyrate.h"
+
+static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
+static struct DirtyRateStat DirtyStat;
+
+static bool dirtyrate_set_state(int old_state, int new_state)
+{
+    assert(new_state < DIRTY_RATE_STATUS__MAX);
+    return atomic_cmpxchg(&CalculatingState, old_state, new_state) ==
+           old_state;
+}
+
+/* Wait until @msec have passed since @initial_time, return the period */
+static int64_t dirtyrate_wait_period(int64_t msec, int64_t initial_time)
+{
+    int64_t current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (current_time - initial_time >= msec) {
+        return current_time - initial_time;
+    }
+
+    g_usleep((msec + initial_time - current_time) * 1000);
+    return msec;
+}
+
+static void reset_dirtyrate_stat(int64_t start_time,
+                                 struct DirtyRateConfig *config)
+{
+    DirtyStat.total_dirty_samples = 0;
+    DirtyStat.total_sample_count = 0;
+    DirtyStat.total_block_mem_MB = 0;
+    DirtyStat.dirty_rate = -1;
+    DirtyStat.start_time = start_time;
+    DirtyStat.calc_time = config->sample_period_seconds;
+    DirtyStat.sample_pages = config->sample_pages_per_gigabytes;
+}
+
+static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
+{
+    DirtyStat.total_dirty_samples += info->sample_dirty_count;
+    DirtyStat.total_sample_count += info->sample_pages_count;
+    DirtyStat.total_block_mem_MB +=
+        (info->ramblock_pages * TARGET_PAGE_SIZE) / MiB;
+}
+
+static void update_dirtyrate(int64_t msec)
+{
+    uint64_t dirty_rate = 0;
+
+    if (DirtyStat.total_sample_count) {
+        dirty_rate = DirtyStat.total_dirty_samples *
+                     DirtyStat.total_block_mem_MB * 1000 /
+                     (DirtyStat.total_sample_count * msec);
+    }
+    DirtyStat.dirty_rate = dirty_rate;
+}
+
+static uint32_t get_ramblock_vfn_hash(struct RamblockDirtyInfo *info,
+                                      uint64_t vfn)
+{
+    return crc32(0, info->ramblock_addr + vfn * TARGET_PAGE_SIZE,
+                 TARGET_PAGE_SIZE);
+}
+
+static bool save_ramblock_hash(struct RamblockDirtyInfo *info, GRand *rand)
+{
+    uint64_t i;
+
+    if (!info->sample_pages_count) {
+        return true;
+    }
+
+    info->hash_result = g_try_new0(uint32_t, info->sample_pages_count);
+    info->sample_page_vfn = g_try_new0(uint64_t, info->sample_pages_count);
+    if (!info->hash_result || !info->sample_page_vfn) {
+        return false;
+    }
+
+    for (i = 0; i < info->sample_pages_count; i++) {
+        /* g_rand_int_range() would not cover blocks past 8 TiB */
+        info->sample_page_vfn[i] = g_rand_double(rand) * info->ramblock_pages;
+        info->hash_result[i] = get_ramblock_vfn_hash(info,
+                                                     info->sample_page_vfn[i]);
+    }
+
+    return true;
+}
+
+static void get_ramblock_dirty_info(RAMBlock *block,
+                                    struct RamblockDirtyInfo *info,
+                                    struct DirtyRateConfig *config)
+{
+    uint64_t length = qemu_ram_get_used_length(block);
+
+    info->ramblock_pages = length >> TARGET_PAGE_BITS;
+    info->sample_pages_count = (length * config->sample_pages_per_gigabytes) /
+                               GiB;
+    info->ramblock_addr = qemu_ram_get_host_addr(block);
+    pstrcpy(info->idstr, sizeof(info->idstr), qemu_ram_get_idstr(block));
+}
+
+static void free_ramblock_dirty_info(struct RamblockDirtyInfo *infos,
+                                     int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        g_free(infos[i].sample_page_vfn);
+        g_free(infos[i].hash_result);
+    }
+    g_free(infos);
+}
+
+static bool skip_sample_ramblock(RAMBlock *block)
+{
+    return qemu_ram_get_used_length(block) < DIRTYRATE_MIN_RAMBLOCK_SIZE;
+}
+
+/* Hash the samples of every RAM block.  Called with the RCU lock held. */
+static bool record_ramblock_hash_info(struct RamblockDirtyInfo **block_dinfo,
+                                      struct DirtyRateConfig *config,
+                                      int *block_count)
+{
+    struct RamblockDirtyInfo *dinfo;
+    RAMBlock *block;
+    GRand *rand;
+    int total_count = 0;
+    int index = 0;
+    bool ret = true;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (!skip_sample_ramblock(block)) {
+            total_count++;
+        }
+    }
+
+    dinfo = g_try_new0(struct RamblockDirtyInfo, total_count);
+    if (total_count && !dinfo) {
+        return false;
+    }
+
+    rand = g_rand_new();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (skip_sample_ramblock(block)) {
+            continue;
+        }
+        if (index == total_count) {
+            break;
+        }
+        get_ramblock_dirty_info(block, &dinfo[index], config);
+        if (!save_ramblock_hash(&dinfo[index], rand)) {
+            index++;
+            ret = false;
+            break;
+        }
+        index++;
+    }
+    g_rand_free(rand);
+
+    *block_dinfo = dinfo;
+    *block_count = index;
+
+    return ret;
+}
+
+static void calc_page_dirty_rate(struct RamblockDirtyInfo *info)
+{
+    uint64_t i;
+
+    for (i = 0; i < info->sample_pages_count; i++) {
+        if (get_ramblock_vfn_hash(info, info->sample_page_vfn[i]) !=
+            info->hash_result[i]) {
+            info->sample_dirty_count++;
+        }
+    }
+}
+
+static struct RamblockDirtyInfo *
+find_block_matched(RAMBlock *block, int count,
+                   struct RamblockDirtyInfo *infos)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!strcmp(infos[i].idstr, qemu_ram_get_idstr(block))) {
+            break;
+        }
+    }
+
+    if (i == count) {
+        return NULL;
+    }
+
+    /* The block was resized or reallocated during the period */
+    if (infos[i].ramblock_addr != qemu_ram_get_host_addr(block) ||
+        infos[i].ramblock_pages !=
+            (qemu_ram_get_used_length(block) >> TARGET_PAGE_BITS)) {
+        return NULL;
+    }
+
+    return &infos[i];
+}
+
+/*
+ * Hash the samples again and compare.  Called with the RCU lock held;
+ * blocks that went away during the period are left out of the estimate.
+ */
+static void compare_page_hash_info(struct RamblockDirtyInfo *info,
+                                   int block_count)
+{
+    struct RamblockDirtyInfo *block_dinfo;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (skip_sample_ramblock(block)) {
+            continue;
+        }
+        block_dinfo = find_block_matched(block, block_count, info);
+        if (!block_dinfo) {
+            continue;
+        }
+        calc_page_dirty_rate(block_dinfo);
+        update_dirtyrate_stat(block_dinfo);
+    }
+}
+
+static void calculate_dirtyrate(struct DirtyRateConfig *config)
+{
+    struct RamblockDirtyInfo *block_dinfo = NULL;
+    int block_count = 0;
+    int64_t msec;
+    int64_t initial_time;
+
+    rcu_read_lock();
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (!record_ramblock_hash_info(&block_dinfo, config, &block_count)) {
+        rcu_read_unlock();
+        goto out;
+    }
+    rcu_read_unlock();
+
+    msec = dirtyrate_wait_period(config->sample_period_seconds * 1000,
+                                 initial_time);
+
+    rcu_read_lock();
+    compare_page_hash_info(block_dinfo, block_count);
+    rcu_read_unlock();
+
+    update_dirtyrate(msec);
+
+out:
+    free_ramblock_dirty_info(block_dinfo, block_count);
+}
+
+static void *get_dirtyrate_thread(void *arg)
+{
+    struct DirtyRateConfig *config = arg;
+
+    rcu_register_thread();
+
+    calculate_dirtyrate(config);
+    trace_dirtyrate_calculate(DirtyStat.dirty_rate,
+                              DirtyStat.total_dirty_samples,
+                              DirtyStat.total_sample_count);
+
+    dirtyrate_set_state(DIRTY_RATE_STATUS_MEASURING,
+                        DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    static struct DirtyRateConfig config;
+    QemuThread thread;
+    int state = atomic_read(&CalculatingState);
+
+    if (state == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "the dirty rate is already being measured");
+        return;
+    }
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be in the range %d to %d",
+                   DIRTYRATE_MIN_CALC_TIME, DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "sample-pages must be in the range %d to %d",
+                   DIRTYRATE_MIN_SAMPLE_PAGES, DIRTYRATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+
+    if (!dirtyrate_set_state(state, DIRTY_RATE_STATUS_MEASURING)) {
+        error_setg(errp, "the dirty rate is already being measured");
+        return;
+    }
+
+    /* Only one measurement runs at a time, so config can be shared */
+    config.sample_period_seconds = calc_time;
+    config.sample_pages_per_gigabytes = sample_pages;
+    reset_dirtyrate_stat(qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000, &config);
+
+    qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
+                       &config, QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = atomic_read(&CalculatingState);
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = DirtyStat.dirty_rate;
+    }
+    info->start_time = DirtyStat.start_time;
+    info->calc_time = DirtyStat.calc_time;
+    info->sample_pages = DirtyStat.sample_pages;
+
+    return info;
+}
@@ -0,0 +1,65 @@
+/*
+ * Dirty page rate estimation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/* Default number of pages sampled per GiB of RAM */
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES    512
+#define DIRTYRATE_MIN_SAMPLE_PAGES        128
+#define DIRTYRATE_MAX_SAMPLE_PAGES        4096
+
+/* Range of the measurement period, in seconds */
+#define DIRTYRATE_MIN_CALC_TIME           1
+#define DIRTYRATE_MAX_CALC_TIME           60
+
+/* RAM blocks smaller than this (e.g. ROMs) are not sampled */
+#define DIRTYRATE_MIN_RAMBLOCK_SIZE       (128 * MiB)
+
+struct DirtyRateConfig {
+    /* pages sampled per GiB of RAM */
+    uint64_t sample_pages_per_gigabytes;
+    /* measurement period in seconds */
+    int64_t sample_period_seconds;
+};
+
+/* Sampled pages of a single RAM block */
+struct RamblockDirtyInfo {
+    /* name of the RAM block */
+    char idstr[256];
+    /* host address of the RAM block */
+    uint8_t *ramblock_addr;
+    /* number of pages in the RAM block */
+    uint64_t ramblock_pages;
+    /* page index of each sample */
+    uint64_t *sample_page_vfn;
+    /* number of samples */
+    uint64_t sample_pages_count;
+    /* number of samples whose page changed */
+    uint64_t sample_dirty_count;
+    /* hash of each sample at the start of the period */
+    uint32_t *hash_result;
+};
+
+struct DirtyRateStat {
+    /* samples whose page changed during the period */
+    uint64_t total_dirty_samples;
+    /* samples taken */
+    uint64_t total_sample_count;
+    /* size of the sampled RAM blocks in MiB */
+    uint64_t total_block_mem_MB;
+    /* estimated dirty rate in MB/s */
+    int64_t dirty_rate;
+    /* start of the measurement, in seconds since the Epoch */
+    int64_t start_time;
+    /* measurement period in seconds */
+    int64_t calc_time;
+    /* pages sampled per GiB of RAM */
+    uint64_t sample_pages;
+};
+
+#endif
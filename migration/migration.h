@@ -266,9 +266,14 @@ bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
 
 bool migrate_auto_converge(void);
+bool migrate_per_vcpu_throttle(void);
 bool migrate_use_multifd(void);
+bool migrate_use_zero_copy_send(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
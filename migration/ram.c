@@ -57,6 +57,7 @@
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "multifd.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -170,10 +171,6 @@ static bool ramblock_is_ignored(RAMBlock *block)
     INTERNAL_RAMBLOCK_FOREACH(block)                   \
         if (ramblock_is_ignored(block)) {} else
 
-#define RAMBLOCK_FOREACH_MIGRATABLE(block)             \
-    INTERNAL_RAMBLOCK_FOREACH(block)                   \
-        if (!qemu_ram_is_migratable(block)) {} else
-
 #undef RAMBLOCK_FOREACH
 
 int foreach_not_ignored_block(RAMBlockIterFunc func, void *opaque)
@@ -327,6 +324,10 @@ struct RAMState {
     uint64_t bytes_xfer_prev;
     /* number of dirty pages since start_time */
     uint64_t num_dirty_pages_period;
+    /* per-vcpu dirty page counters at start_time, indexed by cpu_index */
+    uint64_t *vcpu_dirty_pages_prev;
+    /* per-vcpu dirty pages during the last period, indexed by cpu_index */
+    uint64_t *vcpu_dirty_pages_period;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
 
@@ -578,125 +579,154 @@ exit:
 
 /* Multiple fd's */
 
-#define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
-
-#define MULTIFD_FLAG_SYNC (1 << 0)
-
-/* This value needs to be a multiple of qemu_target_page_size() */
-#define MULTIFD_PACKET_SIZE (512 * 1024)
-
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    unsigned char uuid[16]; /* QemuUUID */
-    uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
-    uint64_t unused2[4];    /* Reserved for future use */
-} __attribute__((packed)) MultiFDInit_t;
-
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t flags;
-    /* maximum number of allocated pages */
-    uint32_t pages_alloc;
-    uint32_t pages_used;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
-    char ramblock[256];
-    uint64_t offset[];
-} __attribute__((packed)) MultiFDPacket_t;
-
-typedef struct {
-    /* number of used pages */
-    uint32_t used;
-    /* number of allocated pages */
-    uint32_t allocated;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* offset of each page */
-    ram_addr_t *offset;
-    /* pointer to each page */
-    struct iovec *iov;
-    RAMBlock *block;
-} MultiFDPages_t;
-
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* sem where to wait for more work */
-    QemuSemaphore sem;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* thread has work to do */
-    int pending_job;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-}  MultiFDSendParams;
-
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* array of pages to receive */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-} MultiFDRecvParams;
+/* Multifd without compression */
+
+/**
+ * nocomp_send_setup: setup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    return 0;
+}
+
+/**
+ * nocomp_send_cleanup: cleanup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    return;
+}
+
+/**
+ * nocomp_send_prepare: prepare data to be able to send
+ *
+ * For no compression we just have to calculate the size of the
+ * packet.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    p->next_packet_size = used * qemu_target_page_size();
+    return 0;
+}
+
+/**
+ * nocomp_send_write: do the actual write of the data
+ *
+ * For no compression we just have to write the data.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used, NULL, 0,
+                                       p->write_flags, errp);
+}
+
+/**
+ * nocomp_recv_setup: setup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    return 0;
+}
+
+/**
+ * nocomp_recv_cleanup: cleanup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void nocomp_recv_cleanup(MultiFDRecvParams *p)
+{
+}
+
+/**
+ * nocomp_recv_pages: read the data from the channel into actual pages
+ *
+ * For no compression we just need to read things into the correct place.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    if (p->next_packet_size != used * qemu_target_page_size()) {
+        error_setg(errp, "multifd %d: received packet of %u bytes and "
+                   "expected %u bytes", p->id, p->next_packet_size,
+                   used * (uint32_t)qemu_target_page_size());
+        return -1;
+    }
+    return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
+}
+
+static MultiFDMethods multifd_nocomp_ops = {
+    .send_setup = nocomp_send_setup,
+    .send_cleanup = nocomp_send_cleanup,
+    .send_prepare = nocomp_send_prepare,
+    .send_write = nocomp_send_write,
+    .recv_setup = nocomp_recv_setup,
+    .recv_cleanup = nocomp_recv_cleanup,
+    .recv_pages = nocomp_recv_pages
+};
+
+static MultiFDMethods *multifd_ops[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = &multifd_nocomp_ops,
+};
+
+void multifd_register_ops(int method, MultiFDMethods *ops)
+{
+    assert(0 < method && method < MULTIFD_COMPRESSION__MAX);
+    multifd_ops[method] = ops;
+}
+
+/*
+ * Packet flags that identify a compression method on the wire.  The
+ * receiving side refuses packets compressed with a method other than
+ * the one it has been configured with.
+ */
+static const uint32_t multifd_compression_flags[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = MULTIFD_FLAG_NOCOMP,
+    [MULTIFD_COMPRESSION_ZLIB] = MULTIFD_FLAG_ZLIB,
+#ifdef CONFIG_ZSTD
+    [MULTIFD_COMPRESSION_ZSTD] = MULTIFD_FLAG_ZSTD,
+#endif
+};
 
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
@@ -792,7 +822,8 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
     packet->version = cpu_to_be32(MULTIFD_VERSION);
-    packet->flags = cpu_to_be32(p->flags);
+    packet->flags = cpu_to_be32(p->flags |
+        multifd_compression_flags[migrate_multifd_compression()]);
     packet->pages_alloc = cpu_to_be32(page_max);
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
@@ -831,6 +862,14 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->flags = be32_to_cpu(packet->flags);
+    if ((p->flags & MULTIFD_FLAG_COMPRESSION_MASK) !=
+        multifd_compression_flags[migrate_multifd_compression()]) {
+        error_setg(errp, "multifd: received packet "
+                   "with compression flags 0x%x and expected 0x%x",
+                   p->flags & MULTIFD_FLAG_COMPRESSION_MASK,
+                   multifd_compression_flags[migrate_multifd_compression()]);
+        return -1;
+    }
 
     packet->pages_alloc = be32_to_cpu(packet->pages_alloc);
     /*
@@ -900,8 +939,25 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* multifd ops */
+    MultiFDMethods *ops;
 } *multifd_send_state;
 
+/*
+ * Account the bytes that a channel has written since the last time we
+ * looked at it.  Compression makes the amount of data on the wire
+ * unknown until the channel has done its job, so the channel thread
+ * keeps track of it and the migration thread collects it.
+ *
+ * Must be called with p->mutex held.
+ */
+static void multifd_account_bytes(MultiFDSendParams *p)
+{
+    ram_counters.multifd_bytes += p->bytes_sent;
+    ram_counters.transferred += p->bytes_sent;
+    p->bytes_sent = 0;
+}
+
 /*
  * How we use multifd_send_state->pages and channel->pages?
  *
@@ -926,13 +982,17 @@ static void multifd_send_pages(void)
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     qemu_sem_wait(&multifd_send_state->channels_ready);
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
         p = &multifd_send_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            /* A channel failed, so does the migration; drop the pages */
+            qemu_mutex_unlock(&p->mutex);
+            return;
+        }
         if (!p->pending_job) {
             p->pending_job++;
             next_channel = (i + 1) % migrate_multifd_channels();
@@ -946,9 +1006,7 @@ static void multifd_send_pages(void)
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
+    multifd_account_bytes(p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 }
@@ -1016,6 +1074,8 @@ void multifd_save_cleanup(void)
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
+        Error *local_err = NULL;
+
         if (p->running) {
             qemu_thread_join(&p->thread);
         }
@@ -1030,6 +1090,11 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        multifd_send_state->ops->send_cleanup(p, &local_err);
+        if (local_err) {
+            migrate_set_error(migrate_get_current(), local_err);
+            error_free(local_err);
+        }
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     qemu_sem_destroy(&multifd_send_state->sem_sync);
@@ -1057,6 +1122,10 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_signal(p->id);
 
         qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            return;
+        }
 
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
@@ -1070,6 +1139,13 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_send_state->sem_sync);
     }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_account_bytes(p);
+        qemu_mutex_unlock(&p->mutex);
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
@@ -1097,14 +1173,27 @@ static void *multifd_send_thread(void *opaque)
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
 
-            p->next_packet_size = used * qemu_target_page_size();
+            p->next_packet_size = 0;
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
-            p->pages->used = 0;
             qemu_mutex_unlock(&p->mutex);
 
+            /*
+             * The pages and the packet belong to this channel until
+             * pending_job is dropped, so compress without holding the
+             * mutex and only then fill in the size of the payload.
+             */
+            if (used) {
+                ret = multifd_send_state->ops->send_prepare(p, used,
+                                                            &local_err);
+                if (ret != 0) {
+                    break;
+                }
+                p->packet->next_packet_size = cpu_to_be32(p->next_packet_size);
+            }
+
             trace_multifd_send(p->id, packet_num, used, flags,
                                p->next_packet_size);
 
@@ -1115,18 +1204,32 @@ static void *multifd_send_thread(void *opaque)
             }
 
             if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
+                ret = multifd_send_state->ops->send_write(p, used,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
 
             qemu_mutex_lock(&p->mutex);
+            p->bytes_sent += p->packet_len + p->next_packet_size;
+            p->pages->used = 0;
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
+                /*
+                 * With zero copy the kernel may still be reading pages
+                 * queued before the sync; wait for it so a completed
+                 * sync really means that everything has been sent.
+                 */
+                if (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+                    ret = qio_channel_flush(p->c, &local_err);
+                    if (ret < 0) {
+                        break;
+                    }
+                    trace_multifd_send_flush(p->id, ret == 1);
+                }
                 qemu_sem_post(&multifd_send_state->sem_sync);
             }
             qemu_sem_post(&multifd_send_state->channels_ready);
@@ -1148,6 +1251,10 @@ out:
     p->running = false;
     qemu_mutex_unlock(&p->mutex);
 
+    /* The migration thread may be waiting for this channel */
+    qemu_sem_post(&multifd_send_state->sem_sync);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
     rcu_unregister_thread();
     trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
 
@@ -1160,7 +1267,16 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     QIOChannel *sioc = QIO_CHANNEL(qio_task_get_source(task));
     Error *local_err = NULL;
 
-    if (qio_task_propagate_error(task, &local_err)) {
+    if (!qio_task_propagate_error(task, &local_err) &&
+        (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+        !qio_channel_has_feature(sioc, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        /* Let multifd_save_cleanup() release the channel */
+        p->c = sioc;
+        error_setg(&local_err, "multifd %d: the host does not support "
+                   "zero copy send on this channel", p->id);
+    }
+
+    if (local_err) {
         migrate_set_error(migrate_get_current(), local_err);
         multifd_save_cleanup();
     } else {
@@ -1176,17 +1292,24 @@ int multifd_save_setup(void)
 {
     int thread_count;
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    MultiFDCompression method = migrate_multifd_compression();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
         return 0;
     }
+    if (!multifd_ops[method]) {
+        error_report("multifd: compression method %s is not available",
+                     MultiFDCompression_str(method));
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    multifd_send_state->ops = multifd_ops[method];
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1201,6 +1324,24 @@ int multifd_save_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdsend_%d", i);
+        if (migrate_use_zero_copy_send()) {
+            p->write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        Error *local_err = NULL;
+
+        if (multifd_send_state->ops->send_setup(p, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
     return 0;
@@ -1214,6 +1355,8 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* multifd ops */
+    MultiFDMethods *ops;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -1269,6 +1412,7 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
@@ -1344,8 +1488,7 @@ static void *multifd_recv_thread(void *opaque)
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
+            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
             if (ret != 0) {
                 break;
             }
@@ -1364,6 +1507,9 @@ static void *multifd_recv_thread(void *opaque)
     p->running = false;
     qemu_mutex_unlock(&p->mutex);
 
+    /* The incoming migration may be waiting for this channel */
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+
     rcu_unregister_thread();
     trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
 
@@ -1374,19 +1520,27 @@ int multifd_load_setup(void)
 {
     int thread_count;
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    MultiFDCompression method = migrate_multifd_compression();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
         return 0;
     }
+    if (!multifd_ops[method]) {
+        error_report("multifd: compression method %s is not available",
+                     MultiFDCompression_str(method));
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    multifd_recv_state->ops = multifd_ops[method];
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        Error *local_err = NULL;
 
         qemu_mutex_init(&p->mutex);
         qemu_sem_init(&p->sem_sync, 0);
@@ -1396,6 +1550,10 @@ int multifd_load_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
+        if (multifd_recv_state->ops->recv_setup(p, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
     }
     return 0;
 }
@@ -1513,6 +1671,101 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/**
+ * mig_throttle_vcpus_sample: sample the dirty pages of each vcpu
+ *
+ * Record how many pages each vcpu dirtied since the previous sample.
+ * The first sample only sets the starting point.  Must be called with
+ * the iothread lock held, after the dirty rings have been harvested.
+ *
+ * @rs: current RAM state
+ */
+static void mig_throttle_vcpus_sample(RAMState *rs)
+{
+    CPUState *cpu;
+    bool first = !rs->vcpu_dirty_pages_prev;
+
+    if (first) {
+        rs->vcpu_dirty_pages_prev = g_new0(uint64_t, max_cpus);
+        rs->vcpu_dirty_pages_period = g_new0(uint64_t, max_cpus);
+    }
+
+    CPU_FOREACH(cpu) {
+        uint64_t pages = cpu->dirty_pages;
+        int idx = cpu->cpu_index;
+
+        assert(idx < max_cpus);
+        /* A vcpu that was unplugged and plugged again starts from 0 */
+        if (pages < rs->vcpu_dirty_pages_prev[idx]) {
+            rs->vcpu_dirty_pages_prev[idx] = 0;
+        }
+        rs->vcpu_dirty_pages_period[idx] = first ? 0 :
+            pages - rs->vcpu_dirty_pages_prev[idx];
+        rs->vcpu_dirty_pages_prev[idx] = pages;
+    }
+}
+
+/**
+ * mig_throttle_vcpus_down: throttle down the vcpus dirtying the most
+ *
+ * Like mig_throttle_guest_down, but only slows down the vcpus that
+ * dirtied more than their fair share of pages during the last period,
+ * so vcpus that barely write to memory keep running at full speed.
+ * If none did, e.g. with a single vcpu or vcpus that dirty memory
+ * evenly, every vcpu that dirtied pages is throttled.  The vcpu that
+ * dirtied the most gets the full initial or increment step, the others
+ * a step proportional to their dirty rate.
+ *
+ * @rs: current RAM state
+ */
+static void mig_throttle_vcpus_down(RAMState *rs)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_initial = s->parameters.cpu_throttle_initial;
+    uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+    int pct_max = s->parameters.max_cpu_throttle;
+    uint64_t total = 0, max_dirty = 0;
+    bool above_share = false;
+    int nr = 0;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        uint64_t dirty = rs->vcpu_dirty_pages_period[cpu->cpu_index];
+
+        total += dirty;
+        max_dirty = MAX(max_dirty, dirty);
+        nr++;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (rs->vcpu_dirty_pages_period[cpu->cpu_index] * nr > total) {
+            above_share = true;
+            break;
+        }
+    }
+
+    /* Nothing to blame on the vcpus, e.g. the pages are dirtied by DMA */
+    if (!total) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        uint64_t dirty = rs->vcpu_dirty_pages_period[cpu->cpu_index];
+        int pct = cpu_throttle_get_vcpu_percentage(cpu);
+        uint64_t step;
+
+        if (!dirty || (above_share && dirty * nr <= total)) {
+            continue;
+        }
+
+        step = pct ? pct_icrement : pct_initial;
+        step = MAX(step * dirty / max_dirty, 1);
+        pct = MIN(pct + step, pct_max);
+        trace_migration_throttle_vcpu(cpu->cpu_index, dirty, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -1759,6 +2012,10 @@ static void migration_bitmap_sync(RAMState *rs)
     trace_migration_bitmap_sync_start();
     memory_global_dirty_log_sync();
 
+    if (migrate_per_vcpu_throttle() && !rs->vcpu_dirty_pages_prev) {
+        mig_throttle_vcpus_sample(rs);
+    }
+
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -1776,10 +2033,15 @@ static void migration_bitmap_sync(RAMState *rs)
     if (end_time > rs->time_last_bitmap_sync + 1000) {
         bytes_xfer_now = ram_counters.transferred;
 
+        if (migrate_per_vcpu_throttle()) {
+            mig_throttle_vcpus_sample(rs);
+        }
+
         /* During block migration the auto-converge logic incorrectly detects
          * that ram migration makes no progress. Avoid this by disabling the
          * throttling logic during the bulk phase of block migration. */
-        if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+        if ((migrate_auto_converge() || migrate_per_vcpu_throttle()) &&
+            !blk_mig_bulk_active()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -1791,7 +2053,11 @@ static void migration_bitmap_sync(RAMState *rs)
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
                     rs->dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    if (migrate_per_vcpu_throttle()) {
+                        mig_throttle_vcpus_down(rs);
+                    } else {
+                        mig_throttle_guest_down();
+                    }
             }
         }
 
@@ -2643,6 +2909,8 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->vcpu_dirty_pages_prev);
+        g_free((*rsp)->vcpu_dirty_pages_period);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -18,6 +18,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu-common.h"
 #include "qapi/error.h"
 #include "trace.h"
 #include "nbd-internal.h"
@@ -34,6 +35,12 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * NBD_SPLICE_PIPE_SIZE: capacity requested for the pipes that carry read
+ * data from the image to the socket.  Larger reads are buffered.
+ */
+#define NBD_SPLICE_PIPE_SIZE (1 * MiB)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -93,6 +100,9 @@ struct NBDExport {
 
     BdrvDirtyBitmap *export_bitmap;
     char *export_bitmap_context;
+
+    /* Set once the block layer failed to splice read data into a pipe */
+    bool no_splice;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -100,6 +110,12 @@ static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
 /* NBDExportMetaContexts represents a list of contexts to be exported,
  * as selected by NBD_OPT_SET_META_CONTEXT. Also used for
  * NBD_OPT_LIST_META_CONTEXT. */
+typedef struct NBDSplicePipe {
+    int fds[2];
+    size_t size; /* capacity of the pipe */
+    QSLIST_ENTRY(NBDSplicePipe) next;
+} NBDSplicePipe;
+
 typedef struct NBDExportMetaContexts {
     NBDExport *exp;
     bool valid; /* means that negotiation of the option finished without
@@ -123,6 +139,9 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    /* Idle pipes for read data that bypasses userspace */
+    QSLIST_HEAD(, NBDSplicePipe) splice_pipes;
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -1347,6 +1366,13 @@ void nbd_client_get(NBDClient *client)
     client->refcount++;
 }
 
+static void nbd_splice_pipe_free(NBDSplicePipe *pipe)
+{
+    close(pipe->fds[0]);
+    close(pipe->fds[1]);
+    g_free(pipe);
+}
+
 void nbd_client_put(NBDClient *client)
 {
     if (--client->refcount == 0) {
@@ -1362,6 +1388,12 @@ void nbd_client_put(NBDClient *client)
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsauthz);
+        while (!QSLIST_EMPTY(&client->splice_pipes)) {
+            NBDSplicePipe *pipe = QSLIST_FIRST(&client->splice_pipes);
+
+            QSLIST_REMOVE_HEAD(&client->splice_pipes, next);
+            nbd_splice_pipe_free(pipe);
+        }
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             nbd_export_put(client->exp);
@@ -1694,6 +1726,157 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+#ifdef CONFIG_SPLICE
+/*
+ * Take an empty pipe from the pool of @client, or create one.  Returns NULL
+ * if no pipe can be created.
+ */
+static NBDSplicePipe *nbd_splice_pipe_get(NBDClient *client)
+{
+    NBDSplicePipe *pipe = QSLIST_FIRST(&client->splice_pipes);
+    int size;
+
+    if (pipe) {
+        QSLIST_REMOVE_HEAD(&client->splice_pipes, next);
+        return pipe;
+    }
+
+    pipe = g_new0(NBDSplicePipe, 1);
+    if (qemu_pipe(pipe->fds) < 0) {
+        g_free(pipe);
+        return NULL;
+    }
+    qemu_set_nonblock(pipe->fds[0]);
+    qemu_set_nonblock(pipe->fds[1]);
+
+    /* If the pipe cannot grow, larger reads just take the buffered path */
+#ifdef F_SETPIPE_SZ
+    fcntl(pipe->fds[1], F_SETPIPE_SZ, NBD_SPLICE_PIPE_SIZE);
+    size = fcntl(pipe->fds[1], F_GETPIPE_SZ);
+#else
+    size = 64 * KiB;
+#endif
+    if (size <= 0) {
+        nbd_splice_pipe_free(pipe);
+        return NULL;
+    }
+    pipe->size = size;
+    return pipe;
+}
+#endif
+
+/*
+ * Read @size bytes of export data at @offset into a pipe, without copying
+ * them through a userspace buffer.  TLS needs the data to encrypt it.
+ *
+ * This happens before send_lock is taken and before the reply header is
+ * built, so that a read error can still be reported with an error reply,
+ * and the block layer never waits for the socket.
+ *
+ * Returns 0 and the filled pipe in @pipep on success.  Returns -ENOTSUP if
+ * the caller has to read into a buffer instead, or another negative errno
+ * if the read failed.
+ */
+static int coroutine_fn nbd_co_splice_read(NBDClient *client, uint64_t offset,
+                                           size_t size, NBDSplicePipe **pipep)
+{
+#ifdef CONFIG_SPLICE
+    NBDExport *exp = client->exp;
+    NBDSplicePipe *pipe;
+    int ret;
+
+    if (client->ioc != QIO_CHANNEL(client->sioc) || exp->no_splice) {
+        return -ENOTSUP;
+    }
+
+    pipe = nbd_splice_pipe_get(client);
+    if (!pipe) {
+        return -ENOTSUP;
+    }
+    if (size > pipe->size) {
+        QSLIST_INSERT_HEAD(&client->splice_pipes, pipe, next);
+        return -ENOTSUP;
+    }
+
+    trace_nbd_co_splice_read(offset, size);
+    ret = blk_co_splice_read(exp->blk, offset + exp->dev_offset, size,
+                             pipe->fds[1]);
+    if (ret < 0) {
+        if (ret == -ENOTSUP) {
+            trace_nbd_co_splice_read_unsupported(exp->name);
+            exp->no_splice = true;
+            QSLIST_INSERT_HEAD(&client->splice_pipes, pipe, next);
+        } else {
+            /* The pipe may hold part of the data */
+            nbd_splice_pipe_free(pipe);
+        }
+        return ret;
+    }
+
+    *pipep = pipe;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+/*
+ * Send the reply header in @iov followed by the @size bytes of data that
+ * nbd_co_splice_read() put into @pipe, and release @pipe.  Errors after the
+ * header was sent cannot be reported to the client anymore and must
+ * terminate the connection.
+ */
+static int coroutine_fn nbd_co_send_iov_pipe(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             NBDSplicePipe *pipe, size_t size,
+                                             Error **errp)
+{
+    int ret = 0;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (qio_channel_writev_all(client->ioc, iov, niov, errp) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+#ifdef CONFIG_SPLICE
+    while (size) {
+        ssize_t len = splice(pipe->fds[0], NULL, client->sioc->fd, NULL, size,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                /* Shutting the socket down wakes us up, too */
+                qio_channel_yield(client->ioc, G_IO_OUT);
+                continue;
+            }
+            error_setg_errno(errp, errno, "sending data failed");
+            ret = -EIO;
+            goto out;
+        }
+        size -= len;
+    }
+#else
+    g_assert_not_reached();
+#endif
+
+out:
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    if (ret < 0) {
+        nbd_splice_pipe_free(pipe);
+    } else {
+        QSLIST_INSERT_HEAD(&client->splice_pipes, pipe, next);
+    }
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1723,6 +1906,24 @@ static int nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
+/* Send a successful simple reply to NBD_CMD_READ with the data in @pipe */
+static int coroutine_fn nbd_co_send_simple_read(NBDClient *client,
+                                                uint64_t handle,
+                                                NBDSplicePipe *pipe,
+                                                size_t size,
+                                                Error **errp)
+{
+    NBDSimpleReply reply;
+    struct iovec iov[] = {
+        {.iov_base = &reply, .iov_len = sizeof(reply)},
+    };
+
+    trace_nbd_co_send_simple_reply(handle, 0, nbd_err_lookup(0), size);
+    set_be_simple_reply(&reply, 0, handle);
+
+    return nbd_co_send_iov_pipe(client, iov, 1, pipe, size, errp);
+}
+
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
                                 uint16_t type, uint64_t handle, uint32_t length)
 {
@@ -1748,12 +1949,17 @@ static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1, errp);
 }
 
+/*
+ * Send an NBD_REPLY_TYPE_OFFSET_DATA chunk.  The data is in @pipe if that is
+ * non-NULL, in @data otherwise.
+ */
 static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                                                     uint64_t handle,
                                                     uint64_t offset,
                                                     void *data,
                                                     size_t size,
                                                     bool final,
+                                                    NBDSplicePipe *pipe,
                                                     Error **errp)
 {
     NBDStructuredReadData chunk;
@@ -1769,6 +1975,9 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
+    if (pipe) {
+        return nbd_co_send_iov_pipe(client, iov, 1, pipe, size, errp);
+    }
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
@@ -1845,15 +2054,20 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
-                            data + progress, pnum);
+            NBDSplicePipe *pipe = NULL;
+
+            ret = nbd_co_splice_read(client, offset + progress, pnum, &pipe);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                                data + progress, pnum);
+            }
             if (ret < 0) {
                 error_setg_errno(errp, -ret, "reading from file failed");
                 break;
             }
             ret = nbd_co_send_structured_read(client, handle, offset + progress,
                                               data + progress, pnum, final,
-                                              errp);
+                                              pipe, errp);
         }
 
         if (ret < 0) {
@@ -2212,6 +2426,26 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->type == NBD_CMD_READ && request->len) {
+        NBDSplicePipe *pipe;
+
+        ret = nbd_co_splice_read(client, request->from, request->len, &pipe);
+        if (ret == 0) {
+            if (client->structured_reply) {
+                return nbd_co_send_structured_read(client, request->handle,
+                                                   request->from, data,
+                                                   request->len, true, pipe,
+                                                   errp);
+            }
+            return nbd_co_send_simple_read(client, request->handle, pipe,
+                                           request->len, errp);
+        }
+        if (ret != -ENOTSUP) {
+            return nbd_send_generic_reply(client, request->handle, ret,
+                                          "reading from file failed", errp);
+        }
+    }
+
     ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
                     request->len);
     if (ret < 0 || request->type == NBD_CMD_CACHE) {
@@ -2223,7 +2457,8 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         if (request->len) {
             return nbd_co_send_structured_read(client, request->handle,
                                                request->from, data,
-                                               request->len, true, errp);
+                                               request->len, true, NULL,
+                                               errp);
         } else {
             return nbd_co_send_structured_done(client, request->handle, errp);
         }
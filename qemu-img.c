@@ -46,6 +46,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "block/thread-pool.h"
 #include "crypto/init.h"
 #include "trace/control.h"
 
@@ -1755,15 +1756,86 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+typedef struct ConvertZeroDetect {
+    ImgConvertState *s;
+    const uint8_t *buf;
+    int64_t sector_num;
+    int nb_sectors;
+    /* Run lengths in sectors: positive for data, negative for zeroes */
+    GArray *runs;
+} ConvertZeroDetect;
+
+static int convert_zero_detect_func(void *opaque)
+{
+    ConvertZeroDetect *zd = opaque;
+    ImgConvertState *s = zd->s;
+    const uint8_t *buf = zd->buf;
+    int64_t sector_num = zd->sector_num;
+    int nb_sectors = zd->nb_sectors;
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+        int len;
+        bool is_data;
+
+        /*
+         * Compressed clusters need to be written as a whole, so in that
+         * case we can only save the write if the buffer is completely
+         * zeroed.
+         */
+        if (s->compressed) {
+            is_data = !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE);
+        } else {
+            is_data = is_allocated_sectors_min(buf, n, &n, s->min_sparse,
+                                               sector_num, s->alignment);
+        }
+        len = is_data ? n : -n;
+        g_array_append_val(zd->runs, len);
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Splits a data buffer into data and zero runs.  This runs in the thread
+ * pool, so that zero detection for several requests happens in parallel and
+ * before the requests have to wait for their turn to be written.
+ */
+static void coroutine_fn convert_co_zero_detect(ImgConvertState *s,
+                                                int64_t sector_num,
+                                                int nb_sectors,
+                                                const uint8_t *buf,
+                                                GArray *runs)
+{
+    ConvertZeroDetect zd = {
+        .s          = s,
+        .buf        = buf,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .runs       = runs,
+    };
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
+
+    g_array_set_size(runs, 0);
+    thread_pool_submit_co(pool, convert_zero_detect_func, &zd);
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
-                                         enum ImgConvertBlockStatus status)
+                                         enum ImgConvertBlockStatus status,
+                                         GArray *runs)
 {
     int ret;
+    guint run = 0;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
         BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
+        bool is_data = true;
 
         switch (status) {
         case BLK_BACKING_FILE:
@@ -1776,17 +1848,17 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
         case BLK_DATA:
             /* If we're told to keep the target fully allocated (-S 0) or there
              * is real non-zero data, we must write it. Otherwise we can treat
-             * it as zero sectors.
-             * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
-            if (!s->min_sparse ||
-                (!s->compressed &&
-                 is_allocated_sectors_min(buf, n, &n, s->min_sparse,
-                                          sector_num, s->alignment)) ||
-                (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
-            {
+             * it as zero sectors; convert_co_zero_detect() has already split
+             * the buffer into data and zero runs. */
+            if (s->min_sparse) {
+                int len;
+
+                assert(run < runs->len);
+                len = g_array_index(runs, int, run++);
+                is_data = len > 0;
+                n = ABS(len);
+            }
+            if (is_data) {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
                 if (ret < 0) {
@@ -1850,10 +1922,34 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/* Wakes the coroutine that waits for its turn at s->wr_offs, if any */
+static void convert_wake_next(ImgConvertState *s, bool schedule)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            if (schedule) {
+                s->wait_sector_num[i] = -1;
+                aio_co_schedule(qemu_get_current_aio_context(), s->co[i]);
+            } else {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
+    GArray *runs;
     int ret, i;
     int index = -1;
 
@@ -1867,12 +1963,14 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
     s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    runs = g_array_new(false, false, sizeof(int));
 
     while (1) {
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        bool turn_passed = false;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1910,6 +2008,8 @@ retry:
                 error_report("error while reading sector %" PRId64
                              ": %s", sector_num, strerror(-ret));
                 s->ret = ret;
+            } else if (s->min_sparse) {
+                convert_co_zero_detect(s, sector_num, n, buf, runs);
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
@@ -1933,7 +2033,19 @@ retry:
                     goto retry;
                 }
             } else {
-                ret = convert_co_write(s, sector_num, n, buf, status);
+                if (s->wr_in_order && s->compressed) {
+                    /*
+                     * The target allocates compressed clusters in submission
+                     * order, so the next request may be submitted as soon as
+                     * this one is.  It is scheduled rather than entered, so
+                     * that it only runs once this request has reached the
+                     * driver and is being compressed.
+                     */
+                    s->wr_offs = sector_num + n;
+                    convert_wake_next(s, true);
+                    turn_passed = true;
+                }
+                ret = convert_co_write(s, sector_num, n, buf, status, runs);
             }
             if (ret < 0) {
                 error_report("error while writing sector %" PRId64
@@ -1942,24 +2054,15 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !turn_passed) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
             s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_wake_next(s, false);
         }
     }
 
+    g_array_free(runs, true);
     qemu_vfree(buf);
     s->co[index] = NULL;
     s->running_coroutines--;
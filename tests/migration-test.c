@@ -442,6 +442,23 @@ static void migrate_set_parameter(QTestState *who, const char *parameter,
     migrate_check_parameter(who, parameter, value);
 }
 
+static void migrate_set_parameter_str(QTestState *who, const char *parameter,
+                                      const char *value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %s } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate-parameters' }");
+    g_assert_cmpstr(qdict_get_str(rsp, parameter), ==, value);
+    qobject_unref(rsp);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -1044,6 +1061,154 @@ static void test_precopy_tcp(void)
     g_free(uri);
 }
 
+/*
+ * Configure multifd with @src_method and @dst_method as the compression
+ * methods, start listening on @listen_uri and return the URI that the
+ * destination listens on.  The destination must use "-incoming defer".
+ */
+static char *test_multifd_setup(QTestState *from, QTestState *to,
+                                const char *listen_uri,
+                                const char *src_method,
+                                const char *dst_method)
+{
+    QDict *rsp;
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter(from, "multifd-channels", 4);
+    migrate_set_parameter(to, "multifd-channels", 4);
+    migrate_set_parameter_str(from, "multifd-compression", src_method);
+    migrate_set_parameter_str(to, "multifd-compression", dst_method);
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s } }", listen_uri);
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    return migrate_get_socket_address(to, "socket-address");
+}
+
+static void test_multifd(const char *listen_uri, const char *method)
+{
+    QTestState *from, *to;
+    char *uri;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    uri = test_multifd_setup(from, to, listen_uri, method, method);
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_tcp_none(void)
+{
+    test_multifd("tcp:127.0.0.1:0", "none");
+}
+
+static void test_multifd_tcp_zlib(void)
+{
+    test_multifd("tcp:127.0.0.1:0", "zlib");
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_zstd(void)
+{
+    test_multifd("tcp:127.0.0.1:0", "zstd");
+}
+#endif
+
+static void test_multifd_unix(const char *method)
+{
+    char *listen_uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    test_multifd(listen_uri, method);
+    g_free(listen_uri);
+}
+
+static void test_multifd_unix_none(void)
+{
+    test_multifd_unix("none");
+}
+
+static void test_multifd_unix_zlib(void)
+{
+    test_multifd_unix("zlib");
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_unix_zstd(void)
+{
+    test_multifd_unix("zstd");
+}
+#endif
+
+/*
+ * The destination refuses pages compressed with another method than its
+ * own.  The migration must fail, and the source keep running.
+ */
+static void test_multifd_mismatch(void)
+{
+    QTestState *from, *to;
+    QDict *rsp_return;
+    char *status;
+    char *uri;
+    bool failed;
+
+    if (test_migrate_start(&from, &to, "defer", true, false)) {
+        return;
+    }
+
+    uri = test_multifd_setup(from, to, "tcp:127.0.0.1:0", "zlib", "none");
+    migrate(from, uri, "{}");
+
+    do {
+        status = migrate_query_status(from);
+        g_assert(!strcmp(status, "setup") || !strcmp(status, "active") ||
+                 !strcmp(status, "failed"));
+        failed = !strcmp(status, "failed");
+        g_free(status);
+        usleep(1000 * 10);
+    } while (!failed);
+
+    /* Is the machine currently running? */
+    rsp_return = wait_command(from, "{ 'execute': 'query-status' }");
+    g_assert(qdict_haskey(rsp_return, "running"));
+    g_assert(qdict_get_bool(rsp_return, "running"));
+    qobject_unref(rsp_return);
+
+    test_migrate_end(from, to, false);
+    g_free(uri);
+}
+
 static void test_migrate_fd_proto(void)
 {
     QTestState *from, *to;
@@ -1183,6 +1348,17 @@ int main(int argc, char **argv)
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+#endif
+    qtest_add_func("/migration/multifd/unix/none", test_multifd_unix_none);
+    qtest_add_func("/migration/multifd/unix/zlib", test_multifd_unix_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/unix/zstd", test_multifd_unix_zstd);
+#endif
+    qtest_add_func("/migration/multifd/mismatch", test_multifd_mismatch);
 
     ret = g_test_run();
 
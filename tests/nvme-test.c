@@ -8,11 +8,20 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "qemu/module.h"
 #include "qemu/units.h"
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "block/nvme.h"
+
+#define NVME_TEST_QUEUE_SIZE    8
+#define NVME_TEST_TIMEOUT_US    (30 * 1000 * 1000)
+
+/* Doorbell offsets with CAP.DSTRD 0 */
+#define NVME_SQ_DB(qid)         (0x1000 + (qid) * 8)
+#define NVME_CQ_DB(qid)         (0x1000 + (qid) * 8 + 4)
 
 typedef struct QNvme QNvme;
 
@@ -44,6 +53,330 @@ static void *nvme_create(void *pci_bus, QGuestAllocator *alloc, void *addr)
     return &nvme->obj;
 }
 
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+    uint16_t cid;
+} NvmeTestQueue;
+
+typedef struct NvmeTest {
+    QPCIDevice *pdev;
+    QPCIBar bar;
+    QGuestAllocator *alloc;
+    NvmeTestQueue admin;
+    NvmeTestQueue io;
+} NvmeTest;
+
+static void nvme_test_queue_init(NvmeTest *t, NvmeTestQueue *q, uint16_t qid)
+{
+    q->qid = qid;
+    q->sq = guest_alloc(t->alloc, NVME_TEST_QUEUE_SIZE * sizeof(NvmeCmd));
+    q->cq = guest_alloc(t->alloc, NVME_TEST_QUEUE_SIZE * sizeof(NvmeCqe));
+    q->sq_tail = q->cq_head = q->cid = 0;
+    q->phase = 1;
+    qtest_memset(global_qtest, q->cq, 0,
+                 NVME_TEST_QUEUE_SIZE * sizeof(NvmeCqe));
+}
+
+/* Put @cmd into the submission queue without ringing the doorbell */
+static void nvme_test_queue_cmd(NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    cmd->cid = cpu_to_le16(q->cid++);
+    memwrite(q->sq + q->sq_tail * sizeof(NvmeCmd), cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % NVME_TEST_QUEUE_SIZE;
+}
+
+/* Wait for the next completion and return its status */
+static uint16_t nvme_test_wait_cqe(NvmeTestQueue *q)
+{
+    gint64 start_time = g_get_monotonic_time();
+    NvmeCqe cqe;
+
+    for (;;) {
+        clock_step(1000);
+        memread(q->cq + q->cq_head * sizeof(NvmeCqe), &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+    }
+
+    q->cq_head = (q->cq_head + 1) % NVME_TEST_QUEUE_SIZE;
+    if (!q->cq_head) {
+        q->phase ^= 1;
+    }
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static uint16_t nvme_test_cmd(NvmeTest *t, NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    uint16_t status;
+
+    nvme_test_queue_cmd(q, cmd);
+    qpci_io_writel(t->pdev, t->bar, NVME_SQ_DB(q->qid), q->sq_tail);
+    status = nvme_test_wait_cqe(q);
+    qpci_io_writel(t->pdev, t->bar, NVME_CQ_DB(q->qid), q->cq_head);
+    return status;
+}
+
+/* Enable the controller with an admin queue pair */
+static void nvme_test_start(NvmeTest *t, QNvme *nvme, QGuestAllocator *alloc)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    t->pdev = &nvme->dev;
+    t->alloc = alloc;
+    qpci_device_enable(t->pdev);
+    t->bar = qpci_iomap(t->pdev, 0, NULL);
+
+    nvme_test_queue_init(t, &t->admin, 0);
+    qpci_io_writel(t->pdev, t->bar, 0x24, (NVME_TEST_QUEUE_SIZE - 1) << 16 |
+                                          (NVME_TEST_QUEUE_SIZE - 1));
+    qpci_io_writel(t->pdev, t->bar, 0x28, t->admin.sq);
+    qpci_io_writel(t->pdev, t->bar, 0x2c, t->admin.sq >> 32);
+    qpci_io_writel(t->pdev, t->bar, 0x30, t->admin.cq);
+    qpci_io_writel(t->pdev, t->bar, 0x34, t->admin.cq >> 32);
+
+    /* 64 byte submission and 16 byte completion queue entries */
+    qpci_io_writel(t->pdev, t->bar, 0x14, 6 << 16 | 4 << 20 | 1);
+    while (!(qpci_io_readl(t->pdev, t->bar, 0x1c) & 1)) {
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+        clock_step(1000);
+    }
+}
+
+/* Create I/O queue pair 1, without interrupts */
+static void nvme_test_create_io_queues(NvmeTest *t)
+{
+    NvmeCmd cmd;
+
+    nvme_test_queue_init(t, &t->io, 1);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_CQ;
+    cmd.prp1 = cpu_to_le64(t->io.cq);
+    cmd.cdw10 = cpu_to_le32((NVME_TEST_QUEUE_SIZE - 1) << 16 | 1);
+    cmd.cdw11 = cpu_to_le32(1);
+    g_assert_cmphex(nvme_test_cmd(t, &t->admin, &cmd), ==, NVME_SUCCESS);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_SQ;
+    cmd.prp1 = cpu_to_le64(t->io.sq);
+    cmd.cdw10 = cpu_to_le32((NVME_TEST_QUEUE_SIZE - 1) << 16 | 1);
+    cmd.cdw11 = cpu_to_le32(1 << 16 | 1);
+    g_assert_cmphex(nvme_test_cmd(t, &t->admin, &cmd), ==, NVME_SUCCESS);
+}
+
+static void nvme_test_sgl_descr(NvmeSglDescriptor *desc, uint64_t addr,
+                                uint32_t len, uint8_t type)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->addr = cpu_to_le64(addr);
+    desc->len = cpu_to_le32(len);
+    desc->type = type << 4;
+}
+
+/* Read @nlb blocks of namespace @nsid into the SGL starting at @sgl */
+static uint16_t nvme_test_read_sgl(NvmeTest *t, uint32_t nsid, uint16_t nlb,
+                                   NvmeSglDescriptor *sgl)
+{
+    NvmeRwCmd rw;
+
+    memset(&rw, 0, sizeof(rw));
+    rw.opcode = NVME_CMD_READ;
+    rw.flags = NVME_PSDT_SGL_MPTR_CONTIG << 6;
+    rw.nsid = cpu_to_le32(nsid);
+    rw.nlb = cpu_to_le16(nlb - 1);
+    memcpy(&rw.prp1, sgl, sizeof(*sgl));
+    return nvme_test_cmd(t, &t->io, (NvmeCmd *)&rw);
+}
+
+/*
+ * A read through a chain of two segments lands in all four data blocks,
+ * and not beyond them.  The drive reads as zeroes.
+ */
+static void nvmetest_sgl_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    NvmeSglDescriptor seg1[3], seg2[2], sgl;
+    uint64_t seg1_addr, seg2_addr, buf[4];
+    uint8_t block[1025];
+    NvmeTest t;
+    int i, j;
+
+    nvme_test_start(&t, obj, alloc);
+    nvme_test_create_io_queues(&t);
+
+    for (i = 0; i < 4; i++) {
+        buf[i] = guest_alloc(alloc, 4 * KiB);
+        qtest_memset(global_qtest, buf[i], 0xff, 4 * KiB);
+    }
+    seg1_addr = guest_alloc(alloc, sizeof(seg1));
+    seg2_addr = guest_alloc(alloc, sizeof(seg2));
+
+    nvme_test_sgl_descr(&seg1[0], buf[0], 1 * KiB,
+                        NVME_SGL_DESCR_TYPE_DATA_BLOCK);
+    nvme_test_sgl_descr(&seg1[1], buf[1], 1 * KiB,
+                        NVME_SGL_DESCR_TYPE_DATA_BLOCK);
+    nvme_test_sgl_descr(&seg1[2], seg2_addr, sizeof(seg2),
+                        NVME_SGL_DESCR_TYPE_LAST_SEGMENT);
+    nvme_test_sgl_descr(&seg2[0], buf[2], 1 * KiB,
+                        NVME_SGL_DESCR_TYPE_DATA_BLOCK);
+    nvme_test_sgl_descr(&seg2[1], buf[3], 1 * KiB,
+                        NVME_SGL_DESCR_TYPE_DATA_BLOCK);
+    memwrite(seg1_addr, seg1, sizeof(seg1));
+    memwrite(seg2_addr, seg2, sizeof(seg2));
+
+    nvme_test_sgl_descr(&sgl, seg1_addr, sizeof(seg1),
+                        NVME_SGL_DESCR_TYPE_SEGMENT);
+    g_assert_cmphex(nvme_test_read_sgl(&t, 1, 8, &sgl), ==, NVME_SUCCESS);
+
+    for (i = 0; i < 4; i++) {
+        memread(buf[i], block, sizeof(block));
+        for (j = 0; j < 1 * KiB; j++) {
+            g_assert_cmphex(block[j], ==, 0);
+        }
+        g_assert_cmphex(block[1 * KiB], ==, 0xff);
+    }
+}
+
+static void nvmetest_sgl_invalid_test(void *obj, void *data,
+                                      QGuestAllocator *alloc)
+{
+    const int cmb_bar_size = 2 * MiB;
+    NvmeSglDescriptor sgl;
+    uint64_t buf;
+    QPCIBar cmb;
+    NvmeTest t;
+
+    nvme_test_start(&t, obj, alloc);
+    nvme_test_create_io_queues(&t);
+    buf = guest_alloc(alloc, 8 * KiB);
+    cmb = qpci_iomap(t.pdev, 2, NULL);
+
+    /* A data block longer than the transfer */
+    nvme_test_sgl_descr(&sgl, buf, 8 * KiB, NVME_SGL_DESCR_TYPE_DATA_BLOCK);
+    g_assert_cmphex(nvme_test_read_sgl(&t, 1, 8, &sgl), ==,
+                    NVME_DATA_SGL_LEN_INVALID | NVME_DNR);
+
+    /* Bit buckets are not supported */
+    nvme_test_sgl_descr(&sgl, 0, 4 * KiB, NVME_SGL_DESCR_TYPE_BIT_BUCKET);
+    g_assert_cmphex(nvme_test_read_sgl(&t, 1, 8, &sgl), ==,
+                    NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR);
+
+    /* A segment that is not a whole number of descriptors */
+    nvme_test_sgl_descr(&sgl, buf, sizeof(NvmeSglDescriptor) + 1,
+                        NVME_SGL_DESCR_TYPE_SEGMENT);
+    g_assert_cmphex(nvme_test_read_sgl(&t, 1, 8, &sgl), ==,
+                    NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR);
+
+    /* A segment that starts in the CMB and ends beyond it */
+    nvme_test_sgl_descr(&sgl, cmb.addr + cmb_bar_size -
+                        sizeof(NvmeSglDescriptor),
+                        2 * sizeof(NvmeSglDescriptor),
+                        NVME_SGL_DESCR_TYPE_SEGMENT);
+    g_assert_cmphex(nvme_test_read_sgl(&t, 1, 8, &sgl), ==,
+                    NVME_INVALID_SGL_SEG_DESCR | NVME_DNR);
+}
+
+/*
+ * Submit I/O through the shadow doorbells of Doorbell Buffer Config.  The
+ * guest only rings the MMIO doorbell when the new tail passes the
+ * EventIdx, and reports the completion queue head in the shadow doorbell.
+ */
+static void nvmetest_dbbuf_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    uint64_t dbs, eis, buf;
+    NvmeSglDescriptor sgl;
+    NvmeRwCmd rw;
+    NvmeCmd cmd;
+    NvmeTest t;
+    int i;
+
+    nvme_test_start(&t, obj, alloc);
+
+    dbs = guest_alloc(alloc, 4 * KiB);
+    eis = guest_alloc(alloc, 4 * KiB);
+    qtest_memset(global_qtest, dbs, 0xff, 4 * KiB);
+    qtest_memset(global_qtest, eis, 0xff, 4 * KiB);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_DBBUF_CONFIG;
+    cmd.prp1 = cpu_to_le64(dbs);
+    cmd.prp2 = cpu_to_le64(eis);
+    g_assert_cmphex(nvme_test_cmd(&t, &t.admin, &cmd), ==, NVME_SUCCESS);
+
+    /* Creating the queues resets their shadow doorbells and EventIdx */
+    nvme_test_create_io_queues(&t);
+    g_assert_cmpuint(readl(dbs + NVME_SQ_DB(1) - 0x1000), ==, 0);
+    g_assert_cmpuint(readl(dbs + NVME_CQ_DB(1) - 0x1000), ==, 0);
+    g_assert_cmpuint(readl(eis + NVME_SQ_DB(1) - 0x1000), ==, 0);
+    g_assert_cmpuint(readl(eis + NVME_CQ_DB(1) - 0x1000), ==, 0);
+
+    buf = guest_alloc(alloc, 4 * KiB);
+    nvme_test_sgl_descr(&sgl, buf, 512, NVME_SGL_DESCR_TYPE_DATA_BLOCK);
+    memset(&rw, 0, sizeof(rw));
+    rw.opcode = NVME_CMD_READ;
+    rw.flags = NVME_PSDT_SGL_MPTR_CONTIG << 6;
+    rw.nsid = cpu_to_le32(1);
+    memcpy(&rw.prp1, &sgl, sizeof(sgl));
+
+    for (i = 1; i <= 2; i++) {
+        /* The new tail passes the EventIdx, so the doorbell is rung */
+        nvme_test_queue_cmd(&t.io, (NvmeCmd *)&rw);
+        writel(dbs + NVME_SQ_DB(1) - 0x1000, t.io.sq_tail);
+        qpci_io_writel(t.pdev, t.bar, NVME_SQ_DB(1), t.io.sq_tail);
+        g_assert_cmphex(nvme_test_wait_cqe(&t.io), ==, NVME_SUCCESS);
+
+        /*
+         * The controller asks for the next submission doorbell, and with
+         * pin-based interrupts for a completion doorbell once the guest
+         * consumed the last entry.
+         */
+        g_assert_cmpuint(readl(eis + NVME_SQ_DB(1) - 0x1000), ==, i);
+        g_assert_cmpuint(readl(eis + NVME_CQ_DB(1) - 0x1000), ==, i - 1);
+
+        /* The head only goes to the shadow doorbell */
+        writel(dbs + NVME_CQ_DB(1) - 0x1000, t.io.cq_head);
+    }
+}
+
+/* The drive is split into two namespaces */
+static void nvmetest_multi_ns_test(void *obj, void *data,
+                                   QGuestAllocator *alloc)
+{
+    uint64_t buf = guest_alloc(alloc, 4 * KiB);
+    NvmeSglDescriptor sgl;
+    uint32_t list[3];
+    NvmeCmd cmd;
+    NvmeTest t;
+
+    nvme_test_start(&t, obj, alloc);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_IDENTIFY;
+    cmd.prp1 = cpu_to_le64(buf);
+    cmd.cdw10 = cpu_to_le32(0x01);
+    g_assert_cmphex(nvme_test_cmd(&t, &t.admin, &cmd), ==, NVME_SUCCESS);
+    g_assert_cmpuint(readl(buf + offsetof(NvmeIdCtrl, nn)), ==, 2);
+
+    cmd.cdw10 = cpu_to_le32(0x02);
+    g_assert_cmphex(nvme_test_cmd(&t, &t.admin, &cmd), ==, NVME_SUCCESS);
+    memread(buf, list, sizeof(list));
+    g_assert_cmpuint(le32_to_cpu(list[0]), ==, 1);
+    g_assert_cmpuint(le32_to_cpu(list[1]), ==, 2);
+    g_assert_cmpuint(le32_to_cpu(list[2]), ==, 0);
+
+    nvme_test_create_io_queues(&t);
+    nvme_test_sgl_descr(&sgl, buf, 512, NVME_SGL_DESCR_TYPE_DATA_BLOCK);
+    g_assert_cmphex(nvme_test_read_sgl(&t, 2, 1, &sgl), ==, NVME_SUCCESS);
+    g_assert_cmphex(nvme_test_read_sgl(&t, 3, 1, &sgl), ==,
+                    NVME_INVALID_NSID | NVME_DNR);
+}
+
 /* This used to cause a NULL pointer dereference.  */
 static void nvmetest_oob_cmb_test(void *obj, void *data, QGuestAllocator *alloc)
 {
@@ -70,7 +403,8 @@ static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
         .extra_device_opts = "addr=04.0,drive=drv0,serial=foo",
-        .before_cmd_line = "-drive id=drv0,if=none,file=null-co://,format=raw",
+        .before_cmd_line = "-drive id=drv0,if=none,file=null-co://,"
+                           "file.read-zeroes=on,format=raw",
     };
 
     add_qpci_address(&opts, &(QPCIAddress) { .devfn = QPCI_DEVFN(4, 0) });
@@ -82,6 +416,16 @@ static void nvme_register_nodes(void)
     qos_add_test("oob-cmb-access", "nvme", nvmetest_oob_cmb_test, &(QOSGraphTestOptions) {
         .edge.extra_device_opts = "cmb_size_mb=2"
     });
+    qos_add_test("sgl", "nvme", nvmetest_sgl_test, NULL);
+    qos_add_test("sgl-invalid", "nvme", nvmetest_sgl_invalid_test,
+                 &(QOSGraphTestOptions) {
+        .edge.extra_device_opts = "cmb_size_mb=2"
+    });
+    qos_add_test("dbbuf", "nvme", nvmetest_dbbuf_test, NULL);
+    qos_add_test("multi-ns", "nvme", nvmetest_multi_ns_test,
+                 &(QOSGraphTestOptions) {
+        .edge.extra_device_opts = "num_namespaces=2"
+    });
 }
 
 libqos_init(nvme_register_nodes);
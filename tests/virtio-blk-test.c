@@ -748,6 +748,173 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+#define MERGE_NREQS 4
+
+/* Wait for the completion of @n requests, in any order */
+static void virtio_blk_wait_used_elems(QVirtioDevice *dev, QVirtQueue *vq,
+                                       const uint32_t *desc_idx, int n)
+{
+    gint64 start_time = g_get_monotonic_time();
+    bool done[MERGE_NREQS] = {};
+    int pending = n;
+    uint32_t got;
+    int i;
+
+    g_assert_cmpint(n, <=, MERGE_NREQS);
+    while (pending) {
+        clock_step(100);
+        dev->bus->get_queue_isr_status(dev, vq);
+
+        while (qvirtqueue_get_buf(vq, &got, NULL)) {
+            for (i = 0; i < n; i++) {
+                if (!done[i] && desc_idx[i] == got) {
+                    break;
+                }
+            }
+            g_assert_cmpint(i, <, n);
+            done[i] = true;
+            pending--;
+        }
+
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+}
+
+/*
+ * Submit MERGE_NREQS requests of @type for adjacent sectors, with one kick
+ * each, and wait for all of them.  Writes fill sector i with 'A' + i, reads
+ * check for that pattern, or for zeroes if @zeroes is true.
+ */
+static void merge_adjacent_reqs(QVirtioDevice *dev, QGuestAllocator *alloc,
+                                QVirtQueue *vq, uint32_t type, bool zeroes)
+{
+    struct virtio_blk_discard_write_zeroes dwz_hdr;
+    uint64_t req_addr[MERGE_NREQS];
+    uint32_t free_head[MERGE_NREQS];
+    QVirtioBlkReq req;
+    size_t data_size;
+    char *data, *expected;
+    uint8_t status;
+    int i;
+
+    if (type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_OUT) {
+        data_size = 512;
+    } else {
+        data_size = sizeof(dwz_hdr);
+    }
+
+    for (i = 0; i < MERGE_NREQS; i++) {
+        req.type = type;
+        req.ioprio = 1;
+        req.sector = i;
+
+        if (data_size == 512) {
+            req.data = g_malloc0(512);
+            if (type == VIRTIO_BLK_T_OUT) {
+                memset(req.data, 'A' + i, 512);
+            }
+        } else {
+            req.data = (char *) &dwz_hdr;
+            dwz_hdr.sector = i;
+            dwz_hdr.num_sectors = 1;
+            dwz_hdr.flags = 0;
+            virtio_blk_fix_dwz_hdr(dev, &dwz_hdr);
+        }
+
+        req_addr[i] = virtio_blk_request(alloc, dev, &req, data_size);
+
+        if (data_size == 512) {
+            g_free(req.data);
+        }
+
+        free_head[i] = qvirtqueue_add(vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(vq, req_addr[i] + 16, data_size,
+                       type == VIRTIO_BLK_T_IN, true);
+        qvirtqueue_add(vq, req_addr[i] + 16 + data_size, 1, true, false);
+        qvirtqueue_kick(dev, vq, free_head[i]);
+    }
+
+    virtio_blk_wait_used_elems(dev, vq, free_head, MERGE_NREQS);
+
+    data = g_malloc(512);
+    expected = g_malloc(512);
+    for (i = 0; i < MERGE_NREQS; i++) {
+        status = readb(req_addr[i] + 16 + data_size);
+        g_assert_cmpint(status, ==, 0);
+
+        if (type == VIRTIO_BLK_T_IN) {
+            memset(expected, zeroes ? 0 : 'A' + i, 512);
+            memread(req_addr[i] + 16, data, 512);
+            g_assert_cmpmem(data, 512, expected, 512);
+        }
+
+        guest_free(alloc, req_addr[i]);
+    }
+    g_free(expected);
+    g_free(data);
+}
+
+/*
+ * With a merge window, requests that the guest submits with separate kicks
+ * are held and merged.  Check that all of them complete with the right data,
+ * and that adjacent discard and write zeroes requests, which are merged
+ * within a virtqueue pass, complete as well.
+ */
+static void merge(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtQueue *vq;
+    uint32_t features;
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    qvirtio_set_driver_ok(dev);
+
+    merge_adjacent_reqs(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, false);
+    merge_adjacent_reqs(dev, t_alloc, vq, VIRTIO_BLK_T_IN, false);
+
+    if (features & (1u << VIRTIO_BLK_F_WRITE_ZEROES)) {
+        merge_adjacent_reqs(dev, t_alloc, vq, VIRTIO_BLK_T_WRITE_ZEROES,
+                            false);
+        merge_adjacent_reqs(dev, t_alloc, vq, VIRTIO_BLK_T_IN, true);
+    }
+
+    if (features & (1u << VIRTIO_BLK_F_DISCARD)) {
+        merge_adjacent_reqs(dev, t_alloc, vq, VIRTIO_BLK_T_DISCARD, false);
+    }
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * Virtqueue 1 is served by a different IOThread than the BlockBackend's, check
+ * that requests on both virtqueues complete.
+ */
+static void multi_iothread(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtQueue *vq0, *vq1;
+
+    vq0 = qvirtqueue_setup(dev, t_alloc, 0);
+    vq1 = qvirtqueue_setup(dev, t_alloc, 1);
+
+    test_basic(dev, t_alloc, vq0);
+    test_basic(dev, t_alloc, vq1);
+
+    qvirtqueue_cleanup(dev->bus, vq1, t_alloc);
+    qvirtqueue_cleanup(dev->bus, vq0, t_alloc);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -760,6 +927,14 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_setup_iothreads(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=iot0"
+                    " -object iothread,id=iot1");
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -771,12 +946,23 @@ static void register_virtio_blk_test(void)
     qos_add_test("basic", "virtio-blk", basic, &opts);
     qos_add_test("resize", "virtio-blk", resize, &opts);
 
+    opts.edge.extra_device_opts = "merge-window-us=1000";
+    qos_add_test("merge-window", "virtio-blk", merge, &opts);
+    opts.edge.extra_device_opts = NULL;
+
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
     qos_add_test("idx", "virtio-blk-pci", idx, &opts);
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_setup_iothreads;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "num-queues=2,iothread=iot0,len-vq-iothreads=2,"
+                             "vq-iothreads[0]=iot0,vq-iothreads[1]=iot1",
+    };
+    qos_add_test("multi-iothread", "virtio-blk-pci", multi_iothread, &opts);
 }
 
 libqos_init(register_virtio_blk_test);